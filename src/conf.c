@@ -128,10 +128,9 @@ conf_parse(struct config* conf, const char* str, size_t len)
     { "bind", conf_command_bind },
   };
 
-  getnextline(NULL, 0, NULL);
-
   char* pbuf;
-  while (getnextline(str, len, &pbuf) != EOF && (pbuf != NULL)) {
+  size_t offset = 0;
+  while (getnextline(str, len, &offset, &pbuf) != EOF && (pbuf != NULL)) {
 
     for (i = 0; i < LEN(tokens); i++) {
       if (strstr(pbuf, tokens[i].key) != pbuf)
@@ -25,12 +25,13 @@
 
 #include "db.h"
 #include "logs.h"
+#include "session.h"
 #include "tetris.h"
 
 static int
-db_open(tetris* pgame, sqlite3** db_handle)
+db_open(struct session* ps, sqlite3** db_handle)
 {
-  int status = sqlite3_open(pgame->db_file, db_handle);
+  int status = sqlite3_open(ps->db_file, db_handle);
   if (status != SQLITE_OK) {
     log_warn("DB cannot be opened. (%d)", status);
     return -1;
@@ -75,8 +76,9 @@ const char select_state[] = "SELECT name,score,lines,level,date,spaces,rowid FRO
 const char delete_state_rowid[] = "DELETE FROM State WHERE ROWID = ?;";
 
 int
-db_save_score(tetris* pgame)
+db_save_score(struct session* ps)
 {
+  tetris* pgame = ps->game;
   sqlite3* db_handle;
   sqlite3_stmt* stmt;
   char insert[4096];
@@ -84,7 +86,7 @@ db_save_score(tetris* pgame)
 
   debug("Trying to insert scores to database");
 
-  if (db_open(pgame, &db_handle) != 1) {
+  if (db_open(ps, &db_handle) != 1) {
     log_err("Unable to save score.");
     return -1;
   }
@@ -95,7 +97,7 @@ db_save_score(tetris* pgame)
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
 
-  insert_len = snprintf(insert, sizeof(insert), insert_scores, pgame->id,
+  insert_len = snprintf(insert, sizeof(insert), insert_scores, ps->id,
                         pgame->level, pgame->score, time(NULL));
 
   if (insert_len >= (int)sizeof(insert)) {
@@ -118,14 +120,15 @@ db_save_score(tetris* pgame)
 }
 
 int
-db_save_state(tetris* pgame)
+db_save_state(struct session* ps)
 {
+  tetris* pgame = ps->game;
   sqlite3* db_handle;
   sqlite3_stmt* stmt;
 
   debug("Saving game state to database");
 
-  if (db_open(pgame, &db_handle) != 1) {
+  if (db_open(ps, &db_handle) != 1) {
     log_err("Unable to save game.");
     return -1;
   }
@@ -158,7 +161,7 @@ db_save_state(tetris* pgame)
   memcpy(&data[0], &pgame->spaces[2], data_len);
   sqlite3_prepare_v2(db_handle, insert, strlen(insert), &stmt, NULL);
 
-  sqlite3_bind_blob(stmt, 1, pgame->id, sizeof(pgame->id), NULL);
+  sqlite3_bind_blob(stmt, 1, ps->id, sizeof(ps->id), NULL);
   sqlite3_bind_blob(stmt, 2, data, data_len, NULL);
 
   sqlite3_step(stmt);
@@ -169,11 +172,13 @@ db_save_state(tetris* pgame)
   return 1;
 }
 
-/* Queries database for newest game state information and copies it to pgame.
+/* Queries database for newest game state information and copies it to the
+ * session's game.
  */
 int
-db_resume_state(tetris* pgame)
+db_resume_state(struct session* ps)
 {
+  tetris* pgame = ps->game;
   sqlite3* db_handle;
   sqlite3_stmt *stmt, *delete;
   const char* blob;
@@ -183,7 +188,7 @@ db_resume_state(tetris* pgame)
 
   debug("Trying to restore saved game");
 
-  if (db_open(pgame, &db_handle) != 1 || db_handle == NULL) {
+  if (db_open(ps, &db_handle) != 1 || db_handle == NULL) {
     log_err("Unable to resume game.");
     return -1;
   }
@@ -192,20 +197,30 @@ db_resume_state(tetris* pgame)
   sqlite3_prepare_v2(db_handle, select_state, sizeof select_state, &stmt, NULL);
 
   if (sqlite3_step(stmt) == SQLITE_ROW) {
+    /* The board goes in first, nothing is restored unless it fits. A save
+     * that doesn't is kept in the table. */
+    blob = sqlite3_column_blob(stmt, 5);
+    if (!blob ||
+        sqlite3_column_bytes(stmt, 5) !=
+          (TETRIS_MAX_ROWS - 2) * (int)sizeof(*pgame->spaces) ||
+        tetris_set_rows(pgame, 2, (const tetris_row*)blob,
+                        TETRIS_MAX_ROWS - 2) != 1) {
+      log_warn("Saved board doesn't fit this game, not resuming");
+      sqlite3_finalize(stmt);
+      db_close(db_handle);
+      return -1;
+    }
+
     if (sqlite3_column_text(stmt, 0))
-      strncpy(pgame->id, (const char*)sqlite3_column_text(stmt, 0),
-              sizeof pgame->id);
-    if (sizeof pgame->id)
-      pgame->id[sizeof(pgame->id) - 1] = '\0';
+      strncpy(ps->id, (const char*)sqlite3_column_text(stmt, 0),
+              sizeof ps->id);
+    if (sizeof ps->id)
+      ps->id[sizeof(ps->id) - 1] = '\0';
 
     pgame->score = sqlite3_column_int(stmt, 1);
     pgame->lines_destroyed = sqlite3_column_int(stmt, 2);
     pgame->level = sqlite3_column_int(stmt, 3);
 
-    blob = sqlite3_column_blob(stmt, 5);
-    memcpy(&pgame->spaces[2], &blob[0],
-           (TETRIS_MAX_ROWS - 2) * sizeof(*pgame->spaces));
-
     rowid = sqlite3_column_int(stmt, 6);
 
     ret = 1;
@@ -231,22 +246,18 @@ db_resume_state(tetris* pgame)
   return ret;
 }
 
-/* Returns a pointer to the first element of a tail queue, of @n length.
- * This list can be iterated over to extract the fields:
+/* Copies up to @n of the best scores to @res, the fields:
  * name, level, score, date.
  */
 int
-db_get_scores(tetris* pgame, tetris** res, size_t n)
+db_get_scores(struct session* ps, struct db_score* res, size_t n)
 {
   sqlite3* db_handle;
   sqlite3_stmt* stmt;
 
   debug("Getting highscores");
 
-  for (size_t i = 0; i < n; i++)
-    res[i] = NULL;
-
-  if (db_open(pgame, &db_handle) != 1 || db_handle == NULL) {
+  if (db_open(ps, &db_handle) != 1 || db_handle == NULL) {
     log_err("Unable to get highscores.");
     return -1;
   }
@@ -263,16 +274,10 @@ db_get_scores(tetris* pgame, tetris** res, size_t n)
       /* improperly formatted row */
       break;
 
-    tetris* np = NULL;
-    if ((np = malloc(sizeof *np)) == NULL) {
-      log_warn("Out of memory");
-      break;
-    }
+    struct db_score* np = &res[i];
 
-    if (sqlite3_column_text(stmt, 0) == NULL) {
-      free(np);
+    if (sqlite3_column_text(stmt, 0) == NULL)
       continue;
-    }
 
     strncpy(np->id, (const char*)sqlite3_column_text(stmt, 0), sizeof np->id);
     if (sizeof np->id > 0)
@@ -282,23 +287,14 @@ db_get_scores(tetris* pgame, tetris** res, size_t n)
     np->score = sqlite3_column_int(stmt, 2);
     np->date = sqlite3_column_int(stmt, 3);
 
-    if (!np->score || !np->date) {
-      free(np);
+    if (!np->score || !np->date)
       continue;
-    }
 
-    res[i++] = np;
+    i++;
   }
 
   sqlite3_finalize(stmt);
   db_close(db_handle);
 
-  return 1;
-}
-
-void
-db_clean_scores(tetris** plist, size_t n)
-{
-  for (size_t i = 0; i < n; i++)
-    free(plist[i]);
+  return i;
 }
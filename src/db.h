@@ -18,21 +18,24 @@
 
 #pragma once
 
-#include "tetris.h"
+#include "session.h"
 #include <stdlib.h>
+#include <time.h>
 
-int db_save_score(tetris*);
-int db_save_state(tetris*);
-int db_resume_state(tetris*);
+int db_save_score(struct session*);
+int db_save_state(struct session*);
+int db_resume_state(struct session*);
 
-/* Get an array of tetris struct pointers containing the data fields of the
- * game save states.
- * - level
- * - score
- * - date
- * - id
- */
-int db_get_scores(tetris*, tetris**, size_t);
+/* One leaderboard entry */
+struct db_score
+{
+  char id[16];
+  uint16_t level;
+  uint32_t score;
+  time_t date;
+};
 
-/* Remove entries in linked list */
-void db_clean_scores(tetris**, size_t);
+/* Fill res with up to n of the best scores, best first.
+ * Returns the number of scores, or -1 on error.
+ */
+int db_get_scores(struct session*, struct db_score* res, size_t n);
@@ -17,6 +17,7 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,15 +31,6 @@
 #include "screen.h"
 #include "tetris.h"
 
-/* Set by signal handler */
-extern volatile sig_atomic_t tetris_do_tick;
-
-/* For POSIX timer, ignore mask blocks the generated signal from everyone but
- * pselect().
- */
-static timer_t timerid;
-static sigset_t ignore_mask;
-
 /* pselect() read/write fd sets */
 static fd_set master_read;
 static fd_set master_write;
@@ -47,57 +39,8 @@ static uint8_t fd_max;
 #define NUM_EVENTS 2
 static events* p_events[NUM_EVENTS];
 
-static int
-events_reset_timer(timer_t td, struct timespec ts)
-{
-  struct itimerspec timer_ts;
-  timer_ts.it_interval.tv_sec = ts.tv_sec;
-  timer_ts.it_interval.tv_nsec = ts.tv_nsec;
-  timer_ts.it_value.tv_sec = ts.tv_sec;
-  timer_ts.it_value.tv_nsec = ts.tv_nsec;
-
-  if (timer_settime(td, 0, &timer_ts, NULL) != 0) {
-    perror("timer_settime()");
-    return -1;
-  }
-
-  return 1;
-}
-
 int
-events_add_timer(struct timespec ts, struct sigaction sa, int sig)
-{
-  sigaddset(&ignore_mask, sig);
-  sigprocmask(SIG_BLOCK, &ignore_mask, NULL);
-
-  sigaction(sig, &sa, NULL);
-
-  struct sigevent evp;
-  memset(&evp, 0, sizeof evp);
-  evp.sigev_notify = SIGEV_SIGNAL;
-  evp.sigev_signo = sig;
-
-  if (timer_create(CLOCK_MONOTONIC, &evp, &timerid) != 0) {
-    perror("timer_create()");
-    return -1;
-  }
-
-  struct itimerspec timer_ts;
-  timer_ts.it_interval.tv_sec = ts.tv_sec;
-  timer_ts.it_interval.tv_nsec = ts.tv_nsec;
-  timer_ts.it_value.tv_sec = ts.tv_sec;
-  timer_ts.it_value.tv_nsec = ts.tv_nsec;
-
-  if (timer_settime(timerid, 0, &timer_ts, NULL) != 0) {
-    perror("timer_settime()");
-    return -1;
-  }
-
-  return 1;
-}
-
-int
-events_add_input(int fd, events_callback cb)
+events_add_input(int fd, events_callback cb, void* data)
 {
   if (fd < 0)
     return 0;
@@ -110,6 +53,7 @@ events_add_input(int fd, events_callback cb)
 
   new_event->fd = fd;
   new_event->cb = cb;
+  new_event->data = data;
 
   size_t i = 0;
   while (i < NUM_EVENTS && p_events[i])
@@ -170,12 +114,29 @@ events_remove_IO(int fd)
   return 1;
 }
 
+/* Nanoseconds from then to now */
+static uint64_t
+events_elapsed(struct timespec* then, const struct timespec* now)
+{
+  uint64_t nsec = (uint64_t)(now->tv_sec - then->tv_sec) * 1000000000 +
+                  now->tv_nsec - then->tv_nsec;
+  *then = *now;
+
+  return nsec;
+}
+
 /* Game is over when this function returns
- * We also handle interrupts in the form of signals from POSIX timers.
+ * We sleep in pselect() until there's input or the game is due a tick, then
+ * move the game on by the time that passed.
  */
 void
-events_main_loop(tetris* pgame)
+events_main_loop(struct session* ps)
 {
+  tetris* pgame = ps->game;
+
+  struct timespec last;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+
   while (1) {
 
     fd_set read_fds = master_read;
@@ -184,8 +145,9 @@ events_main_loop(tetris* pgame)
     sigset_t empty_mask;
     sigemptyset(&empty_mask);
 
+    uint64_t wait = tetris_next_tick(pgame);
     struct timespec ps_timeout = {
-      .tv_nsec = 0, .tv_sec = 2,
+      .tv_nsec = wait % 1000000000, .tv_sec = wait / 1000000000,
     };
 
     errno = 0;
@@ -197,21 +159,15 @@ events_main_loop(tetris* pgame)
       continue;
     }
 
-    if (tetris_do_tick > 0) {
-      tetris_do_tick = 0;
-
-      if (tetris_cmd(pgame, TETRIS_GAME_TICK) < 0)
-        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-      screen_update(pgame);
+    int ticks = tetris_advance(pgame, events_elapsed(&last, &now));
+    if (ticks < 0)
+      return;
 
-      /* Update tick timer */
-      struct timespec ts;
-      ts.tv_sec = 0;
-      ts.tv_nsec = tetris_get_delay(pgame);
-
-      events_reset_timer(timerid, ts);
-    }
+    if (ticks > 0)
+      screen_update(ps);
 
     if (ps_ret <= 0)
       continue;
@@ -232,14 +188,6 @@ events_main_loop(tetris* pgame)
   } /* while */
 }
 
-static void
-events_timer_cleanup(void)
-{
-  if (timerid != 0)
-    timer_delete(timerid);
-  timerid = 0;
-}
-
 static void
 events_IO_cleanup(void)
 {
@@ -252,6 +200,5 @@ events_IO_cleanup(void)
 void
 events_cleanup(void)
 {
-  events_timer_cleanup();
   events_IO_cleanup();
 }
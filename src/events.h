@@ -18,8 +18,7 @@
 
 #pragma once
 
-#include "tetris.h"
-#include <signal.h>
+#include "session.h"
 
 struct events;
 typedef struct events events;
@@ -27,31 +26,27 @@ typedef int (*events_callback)(events*);
 
 /**
  * events structure contains the file descriptor to listen on,
- * and the callback function to call when input is detected on the fd.
+ * the callback function to call when input is detected on the fd,
+ * and the data given when it was added.
  */
 struct events
 {
   int fd;
   events_callback cb;
+  void* data;
 };
 
 /**
  * Listen on File Descriptor fd for IO, then call cb.
  */
-int events_add_input(int fd, events_callback cb);
+int events_add_input(int fd, events_callback cb, void* data);
 int events_remove_IO(int fd);
 /**
- * Create a POSIX timer to signal the program (sig) periodically (timespec).
- * The raised signal is caught by the function defined the (sigaction).
- */
-int events_add_timer(struct timespec, struct sigaction, int sig);
-
-/**
- * Main loop of the program, pselect() for interrupts and keyboard
- * input, handling game commands, etc.
+ * Main loop of the program, pselect() for keyboard input until the game
+ * is due a tick, handling game commands, etc.
  *
  * Returns when the user quits or the game is over.
  */
-void events_main_loop(tetris*);
+void events_main_loop(struct session*);
 
 void events_cleanup(void);
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "helpers.h"
 #include "logs.h"
@@ -158,29 +159,26 @@ cleanup:
 
 /* Give pack a pointer to a location in the buffer of the next line. */
 int
-getnextline(const char* buf, size_t len, char** pbuf)
+getnextline(const char* buf, size_t len, size_t* offset, char** pbuf)
 {
   size_t line_len = 0;
-  static size_t offset = 0;
 
-  if (buf == NULL || len == 0 || pbuf == NULL) {
-    offset = 0;
+  if (buf == NULL || len == 0 || offset == NULL || pbuf == NULL)
     return EOF;
-  }
 
   /* Give back NULL, and return EOF if we run past the buffer */
-  if (offset >= len) {
+  if (*offset >= len) {
     *pbuf = NULL;
     return EOF;
   }
 
   /* Find first non-whitespace character */
-  while (offset < len && isspace(buf[offset]))
-    offset++;
+  while (*offset < len && isspace(buf[*offset]))
+    (*offset)++;
 
   /* Read in one full line */
-  while ((offset + line_len) < len && buf[offset + line_len] != '\n' &&
-         buf[offset + line_len] != '\r')
+  while ((*offset + line_len) < len && buf[*offset + line_len] != '\n' &&
+         buf[*offset + line_len] != '\r')
     line_len++;
 
   *pbuf = calloc(1, line_len + 1);
@@ -190,13 +188,13 @@ getnextline(const char* buf, size_t len, char** pbuf)
   }
 
   /* Take in the line, replace newline or return feed with \0 */
-  strncpy(*pbuf, &buf[offset], line_len);
+  strncpy(*pbuf, &buf[*offset], line_len);
   if (line_len > 0)
     (*pbuf)[line_len] = '\0';
 
-  offset += line_len + 1;
+  *offset += line_len + 1;
 
-  return offset;
+  return *offset;
 }
 
 /* Replaces '~' in a pathname with the user's HOME variable.  */
@@ -243,3 +241,12 @@ replace_home(char** path, size_t* buf_len)
   free(buf);
   return 1;
 }
+
+double
+elapsed(const struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1E9;
+}
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PI 3.141592653589L
@@ -50,8 +51,11 @@ int file_into_buf(const char* path, char** buf, size_t* len);
  *
  * Find beginning of a line that isn't whitespace(newline, space, tab, etc.)
  */
-int getnextline(const char* buf, size_t len, char** pbuf);
+int getnextline(const char* buf, size_t len, size_t* offset, char** pbuf);
 
 /* Replace '~' and "HOME" with the user's HOME environment variable.
  */
 int replace_home(char**, size_t* len);
+
+/* Seconds since start, on the monotonic clock */
+double elapsed(const struct timespec* start);
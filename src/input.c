@@ -28,12 +28,11 @@
 #include <stdlib.h>
 #include <string.h>
 
-extern tetris* pgame;
-extern struct config* config;
-
 int
 keyboard_in_handler(events* pev)
 {
+  struct session* ps = pev->data;
+  struct config* config = ps->config;
   int ret = -1;
 
   struct
@@ -68,8 +67,8 @@ keyboard_in_handler(events* pev)
     if (!actions[i].key->enabled)
       continue;
 
-    ret = tetris_cmd(pgame, actions[i].cmd);
-    screen_update(pgame);
+    ret = tetris_cmd(ps->game, actions[i].cmd);
+    screen_update(ps);
     break;
   }
 
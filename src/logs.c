@@ -31,7 +31,7 @@
  * Wrapper, adds new message to head of linked list
  */
 static int
-_add_to_queue(const char* msg)
+_add_to_queue(struct log_entry_head* head, const char* msg)
 {
   int msg_len = -1;
   struct log_entry* np = calloc(1, sizeof *np);
@@ -48,7 +48,7 @@ _add_to_queue(const char* msg)
 
   strncpy(np->msg, msg, msg_len);
 
-  LIST_INSERT_HEAD(&entry_head, np, entries);
+  LIST_INSERT_HEAD(head, np, entries);
 
   return msg_len;
 }
@@ -57,8 +57,6 @@ _add_to_queue(const char* msg)
 int
 logs_init(const char* path)
 {
-  LIST_INIT(&entry_head);
-
   if (!path)
     return -1;
 
@@ -78,15 +76,6 @@ logs_init(const char* path)
 void
 logs_cleanup(void)
 {
-  struct log_entry* np;
-
-  while (entry_head.lh_first) {
-    np = entry_head.lh_first;
-    LIST_REMOVE(np, entries);
-    free(np->msg);
-    free(np);
-  }
-
   /* Visual Game separator */
   fprintf(stderr, "--\n");
   fclose(stderr);
@@ -94,7 +83,7 @@ logs_cleanup(void)
 
 /* Adds log message to a message queue, to be printed in game */
 void
-logs_to_game(const char* fmt, ...)
+logs_to_game(struct log_entry_head* head, const char* fmt, ...)
 {
   char* debug_message;
   va_list ap;
@@ -107,11 +96,24 @@ logs_to_game(const char* fmt, ...)
   va_end(ap);
 
   if (debug_message)
-    _add_to_queue(debug_message);
+    _add_to_queue(head, debug_message);
 
   free(debug_message);
 }
 
+void
+logs_clear(struct log_entry_head* head)
+{
+  struct log_entry* np;
+
+  while (head->lh_first) {
+    np = head->lh_first;
+    LIST_REMOVE(np, entries);
+    free(np->msg);
+    free(np);
+  }
+}
+
 /* Prints a log message of the form:
  * "[time] message"
  */
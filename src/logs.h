@@ -39,7 +39,7 @@
 #define log_info(M, ...)                                                       \
   logs_to_file("[INFO] " M " (%s:%d)", ##__VA_ARGS__, __FILE__, __LINE__)
 
-LIST_HEAD(log_entry_head, log_entry) entry_head;
+LIST_HEAD(log_entry_head, log_entry);
 struct log_entry
 {
   char* msg;
@@ -49,5 +49,7 @@ struct log_entry
 int logs_init(const char* path);
 void logs_cleanup(void);
 
-void logs_to_game(const char*, ...);
+/* In-game messages are added to the front of the list head */
+void logs_to_game(struct log_entry_head*, const char*, ...);
+void logs_clear(struct log_entry_head*);
 void logs_to_file(const char*, ...);
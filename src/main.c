@@ -17,7 +17,6 @@
  */
 
 #include <locale.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,15 +29,13 @@
 #include "conf.h"
 #include "db.h"
 #include "events.h"
+#include "helpers.h"
 #include "input.h"
 #include "logs.h"
 #include "screen.h"
+#include "session.h"
 #include "tetris.h"
 
-tetris* pgame;
-struct config* config;
-volatile sig_atomic_t tetris_do_tick;
-
 static void
 usage(void)
 {
@@ -63,10 +60,20 @@ usage(void)
   fprintf(stderr, help, __progname, VERSION, __DATE__, __TIME__);
 }
 
-void
-timer_handler(int sig)
+/* Route engine messages to our logs */
+static void
+tetris_log_hook(tetris* pgame, enum TETRIS_LOG_LEVEL level, const char* msg)
 {
-  tetris_do_tick = sig;
+  (void)pgame;
+
+  switch (level) {
+    case TETRIS_LOG_ERR:
+      log_err("%s", msg);
+      break;
+    case TETRIS_LOG_DEBUG:
+      debug("%s", msg);
+      break;
+  }
 }
 
 int
@@ -77,6 +84,10 @@ main(int argc, char** argv)
   char logfile[256];
   int ch;
 
+  struct session session;
+  struct config* config;
+  tetris* pgame;
+
   setlocale(LC_ALL, "");
 
   /* Quit if we're not attached to a tty */
@@ -123,16 +134,29 @@ main(int argc, char** argv)
   if (logs_init(lflag ? logfile : config->logs_file.val) != 1)
     exit(EXIT_FAILURE);
 
+  struct tetris_hooks hooks = {
+    .alloc = malloc, .free = free, .log = tetris_log_hook,
+  };
+  tetris_set_hooks(&hooks);
+
   if (tetris_init(&pgame) != 1 || pgame == NULL)
     exit(EXIT_FAILURE);
 
-  tetris_set_name(pgame, config->username.val);
+  session.game = pgame;
+  session.config = config;
+  LIST_INIT(&session.messages);
+  tetris_events_init(&session.events, session.event_buf,
+                     LEN(session.event_buf));
+  tetris_set_events(pgame, &session.events);
+
+  snprintf(session.id, sizeof session.id, "%s", config->username.val);
 
 #ifdef DEBUG
   /* Use a memory db for debugging */
-  tetris_set_dbfile(pgame, ":memory:");
+  snprintf(session.db_file, sizeof session.db_file, "%s", ":memory:");
 #else
-  tetris_set_dbfile(pgame, config->save_file.val);
+  snprintf(session.db_file, sizeof session.db_file, "%s",
+           config->save_file.val);
 #endif
 
   /* Newer-ish version of tetris with wallkicks, ghost blocks, lock
@@ -143,49 +167,38 @@ main(int argc, char** argv)
   /* Classic tetris, nothing fancy. Play until you lose. */
   //	tetris_set_gamemode(pgame, TETRIS_CLASSIC);
 
-  if (db_resume_state(pgame) != 1)
-    logs_to_game("Unable to resume old game save.");
+  if (db_resume_state(&session) != 1)
+    logs_to_game(&session.messages, "Unable to resume old game save.");
 
   /* Create ncurses context, draw screen, and watch for keyboard input */
   screen_init();
   screen_menu(pgame);
-  screen_update(pgame);
-
-  events_add_input(fileno(stdin), keyboard_in_handler);
-
-  struct timespec ts_tick;
-  ts_tick.tv_sec = 0;
-  ts_tick.tv_nsec = tetris_get_delay(pgame);
-
-  struct sigaction sa_tick;
-  sa_tick.sa_flags = 0;
-  sa_tick.sa_handler = timer_handler;
-  sigemptyset(&sa_tick.sa_mask);
+  screen_update(&session);
 
-  /* Add timer event to trigger game ticks */
-  events_add_timer(ts_tick, sa_tick, SIGRTMIN);
+  events_add_input(fileno(stdin), keyboard_in_handler, &session);
 
   /* Main loop of program */
-  events_main_loop(pgame);
+  events_main_loop(&session);
 
   switch (tetris_get_state(pgame)) {
     case TETRIS_LOSE:
     case TETRIS_WIN:
-      db_save_score(pgame);
+      db_save_score(&session);
       break;
     default:
     case TETRIS_QUIT:
-      db_save_state(pgame);
+      db_save_state(&session);
       break;
   }
 
   /* Cleanup */
-  screen_gameover(pgame);
+  screen_gameover(&session);
   screen_cleanup();
   tetris_cleanup(pgame);
   events_cleanup();
 
   conf_cleanup(config);
+  logs_clear(&session.messages);
   logs_cleanup();
 
   return 0;
@@ -0,0 +1,546 @@
+/*
+ * Copyright (C) 2014  James Smith <james@apertum.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Placement tree counter, like perft for chess engines. From a seeded
+ * position it counts every sequence of places the blocks in the queue can
+ * lock, down to a depth, using the engine's own moves, kicks and line
+ * clears. The counts for a fixed set of positions are known, so a change
+ * to rotations, kicks or line clears that alters them shows up at once, and
+ * the time it takes is a benchmark of the same code.
+ *
+ * With -c every position the tree goes through is also searched a slow way,
+ * trying each command on each place the block can get to, and the places
+ * found have to be the ones tetris_moves() gives. The boards after each move
+ * are evaluated as one batch, which has to agree with the metrics the game
+ * keeps.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "tetris.h"
+
+/* Depths with known counts */
+#define PERFT_KNOWN 5
+
+/* Most rows a position starts with */
+#define PERFT_ROWS 20
+
+/* Most moves a block has, every rotation and box position, with the block
+ * in the hold box too */
+#define PERFT_MAX_MOVES (2 * 4 * TETRIS_MAX_COLUMNS * TETRIS_MAX_ROWS)
+
+struct position
+{
+  const char* name;
+  uint64_t seed;
+
+  /* The bottom rows of the board, '#' for a space that's filled */
+  const char* rows[PERFT_ROWS];
+
+  /* Counts on a 10x22 board in infinity mode, without the hold box */
+  uint64_t nodes[PERFT_KNOWN];
+};
+
+static const struct position positions[] = {
+  { "empty", 1, { NULL }, { 34, 1182, 21165, 386840, 14547678 } },
+  { "tetris",
+    2,
+    { "#########.", "#########.", "#########.", "#########.", NULL },
+    { 34, 585, 10567, 391145, 3815245 } },
+  { "tsd",
+    3,
+    { "....######", "##...#####", "###.######", NULL },
+    { 35, 632, 5929, 106505, 1984264 } },
+  { "tucks",
+    4,
+    { "#........#", "##...#...#", "##.#.##.##", "#..#####.#", "####.#####",
+      "#.########", NULL },
+    { 17, 296, 10765, 399687, 15272347 } },
+  { "high",
+    5,
+    { "....#.....", "###.######", "####.#####", "###.######", "####.#####",
+      "###.######", "####.#####", "###.######", "####.#####", "###.######",
+      "####.#####", "###.######", "####.#####", "###.######", "####.#####",
+      "###.######", "####.#####", NULL },
+    { 17, 267, 7469, 155827, 689820 } },
+};
+
+#define NUM_POSITIONS (sizeof positions / sizeof *positions)
+
+/* Room around the board for a block's pivot, in the slow search */
+#define CHECK_PAD 8
+#define CHECK_COLUMNS (TETRIS_MAX_COLUMNS + 2 * CHECK_PAD)
+#define CHECK_ROWS (TETRIS_MAX_ROWS + 2 * CHECK_PAD)
+
+struct place
+{
+  uint8_t rotation;
+  int8_t column, row;
+};
+
+/* The slow search */
+struct check
+{
+  bool seen[4][CHECK_COLUMNS][CHECK_ROWS];
+  bool spun[4][CHECK_COLUMNS][CHECK_ROWS]; // Got to by a rotation
+  bool last[4][CHECK_COLUMNS][CHECK_ROWS]; // By a rotation's last kick
+  struct place queue[4 * CHECK_COLUMNS * CHECK_ROWS];
+
+  /* The spaces of each place a block locks, its spin flag and last kick */
+  uint64_t want[PERFT_MAX_MOVES], got[PERFT_MAX_MOVES];
+  struct tetris_move moves[PERFT_MAX_MOVES];
+
+  /* The board after each move, and what the game says of it */
+  tetris_row boards[PERFT_MAX_MOVES * TETRIS_MAX_ROWS];
+  struct tetris_features features[PERFT_MAX_MOVES];
+  struct tetris_features metrics[PERFT_MAX_MOVES];
+
+  uint64_t positions;
+  uint64_t boards_evaluated;
+};
+
+struct perft
+{
+  bool bulk; // Count the moves at the last depth, without placing them
+  bool hold;
+
+  struct tetris_move* moves; // PERFT_MAX_MOVES for each depth
+  struct check* check;       // Check tetris_moves() at each position
+};
+
+static void
+usage(void)
+{
+  extern const char* __progname;
+
+  fprintf(stderr,
+          "%s version %s\n\n"
+          "Usage:\n\t"
+          "[-u] usage\n\t"
+          "[-d depth] blocks to place, 4\n\t"
+          "[-p position] only this one of the known positions\n\t"
+          "[-s seed] seed of the block queue, instead of the known ones\n\t"
+          "[-b] place the blocks at the last depth too, not only count\n\t"
+          "[-h] use the hold box\n\t"
+          "[-c] check the moves at every position with a slow search\n\n",
+          __progname, VERSION);
+}
+
+/* Spin flags of a place */
+#define CHECK_SPIN 1
+#define CHECK_LAST_KICK 2
+
+/* The spaces a block fills at a place, sorted, and its spin flags */
+static uint64_t
+place_key(uint8_t type, const struct place* pl, unsigned flags)
+{
+  const struct tetris_shape* shape = &tetris_shapes[type][pl->rotation];
+  uint16_t id[4];
+
+  for (int i = 0; i < 4; i++) {
+    int y = pl->row + shape->p[i].y, x = pl->column + shape->p[i].x;
+    id[i] = y * TETRIS_MAX_COLUMNS + x;
+    for (int j = i; j > 0 && id[j] < id[j - 1]; j--) {
+      uint16_t t = id[j];
+      id[j] = id[j - 1];
+      id[j - 1] = t;
+    }
+  }
+
+  uint64_t key = 0;
+  for (int i = 0; i < 4; i++)
+    key = key << 12 | id[i];
+
+  return key << 2 | flags;
+}
+
+static int
+key_cmp(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* Put the current block at a place, and try a command on it. Returns 1 and
+ * where the block went and the kick it used, 0 when the command locked it, or
+ * -1 when the game is over. */
+static int
+check_try(tetris* pgame, const void* snapshot, const struct place* from,
+          int command, struct place* to, uint8_t* kick)
+{
+  tetris_restore(pgame, snapshot);
+
+  block* pblock = CURRENT_BLOCK(pgame);
+  pblock->rotation = from->rotation;
+  pblock->col_off = from->column;
+  pblock->row_off = from->row;
+
+  uint32_t pieces = tetris_get_pieces(pgame);
+  if (tetris_cmd(pgame, command) == -1)
+    return -1;
+  if (tetris_get_pieces(pgame) != pieces)
+    return 0;
+
+  *to = (struct place){ pblock->rotation, pblock->col_off, pblock->row_off };
+  *kick = pblock->kick;
+  return 1;
+}
+
+/* Search every place the current block gets to with the game's commands, and
+ * check the places it can lock are the ones tetris_moves() gives. Returns the
+ * number of places, or -1 when they differ. */
+static int
+check_moves(struct check* pc, tetris* pgame)
+{
+  static const int commands[] = { TETRIS_MOVE_LEFT, TETRIS_MOVE_RIGHT,
+                                  TETRIS_MOVE_DOWN, TETRIS_ROT_LEFT,
+                                  TETRIS_ROT_RIGHT };
+
+  unsigned char snapshot[TETRIS_SNAPSHOT_SIZE];
+  tetris_snapshot(pgame, snapshot);
+
+  const block* pblock = CURRENT_BLOCK(pgame);
+  uint8_t type = pblock->type;
+  size_t head = 0, tail = 0;
+
+  memset(pc->seen, 0, sizeof pc->seen);
+  memset(pc->spun, 0, sizeof pc->spun);
+  memset(pc->last, 0, sizeof pc->last);
+  pc->queue[tail++] =
+    (struct place){ pblock->rotation, pblock->col_off, pblock->row_off };
+
+  /* A game that's over takes no commands and has no moves */
+  struct place to;
+  uint8_t kick = 0;
+  if (check_try(pgame, snapshot, &pc->queue[0], TETRIS_MOVE_DOWN, &to,
+                &kick) == -1)
+    head = tail;
+
+  size_t n = 0;
+  while (head < tail) {
+    const struct place* pl = &pc->queue[head++];
+    bool locks = false;
+
+    for (int i = 0; i < 5; i++) {
+      if (!check_try(pgame, snapshot, pl, commands[i], &to, &kick)) {
+        locks |= commands[i] == TETRIS_MOVE_DOWN;
+        continue;
+      }
+      if (commands[i] == TETRIS_MOVE_DOWN && to.row == pl->row)
+        locks = true;
+
+      int x = to.column + CHECK_PAD, y = to.row + CHECK_PAD;
+      if (x < 0 || x >= CHECK_COLUMNS || y < 0 || y >= CHECK_ROWS) {
+        fprintf(stderr, "Block went off the board to %d, %d\n", to.column,
+                to.row);
+        exit(EXIT_FAILURE);
+      }
+
+      bool moved = memcmp(&to, pl, sizeof to);
+      if (i >= 3 && moved) {
+        pc->spun[to.rotation][x][y] = true;
+        if (kick == TETRIS_NUM_KICKS - 1)
+          pc->last[to.rotation][x][y] = true;
+      }
+      if (!pc->seen[to.rotation][x][y]) {
+        pc->seen[to.rotation][x][y] = true;
+        pc->queue[tail++] = to;
+      }
+    }
+
+    /* The spin flags are filled in once every place has been seen */
+    if (locks)
+      pc->want[n++] = place_key(type, pl, 0);
+  }
+  tetris_restore(pgame, snapshot);
+
+  /* Rotations of I, S and Z blocks lock in the same spaces, the generator
+   * gives those once, spun if any of them is */
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = pc->want[i];
+    for (size_t j = 0; j < tail; j++) {
+      const struct place* pl = &pc->queue[j];
+      int x = pl->column + CHECK_PAD, y = pl->row + CHECK_PAD;
+      if (place_key(type, pl, 0) != key)
+        continue;
+      if (pc->spun[pl->rotation][x][y])
+        pc->want[i] |= CHECK_SPIN;
+      if (pc->last[pl->rotation][x][y])
+        pc->want[i] |= CHECK_LAST_KICK;
+    }
+  }
+  qsort(pc->want, n, sizeof *pc->want, key_cmp);
+
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++)
+    if (!m || pc->want[m - 1] >> 2 != pc->want[i] >> 2)
+      pc->want[m++] = pc->want[i];
+
+  size_t got = tetris_moves(pgame, pc->moves, PERFT_MAX_MOVES, false);
+  for (size_t i = 0; i < got; i++) {
+    const struct tetris_move* mv = &pc->moves[i];
+    struct place pl = { mv->rotation, mv->column, mv->row };
+    pc->got[i] = place_key(type, &pl,
+                           (mv->spin ? CHECK_SPIN : 0) |
+                             (mv->kick == TETRIS_NUM_KICKS - 1 ? CHECK_LAST_KICK
+                                                                : 0));
+  }
+  qsort(pc->got, got, sizeof *pc->got, key_cmp);
+
+  pc->positions++;
+  if (got != m || memcmp(pc->got, pc->want, m * sizeof *pc->want))
+    return -1;
+
+  return m;
+}
+
+/* Evaluate the boards after each of n moves as one batch, and check the
+ * features the game keeps up to date as blocks lock are the same. Returns
+ * the number of boards, or -1 when any differ. */
+static int
+check_eval(struct check* pc, tetris* pgame, const struct tetris_move* moves,
+           size_t n)
+{
+  unsigned char snapshot[TETRIS_SNAPSHOT_SIZE];
+  tetris_snapshot(pgame, snapshot);
+
+  for (size_t i = 0; i < n; i++) {
+    if (tetris_place_move(pgame, &moves[i]) != 1)
+      return -1;
+
+    memcpy(&pc->boards[i * TETRIS_MAX_ROWS], pgame->spaces,
+           TETRIS_MAX_ROWS * sizeof *pgame->spaces);
+
+    struct tetris_features* pf = &pc->metrics[i];
+    *pf = (struct tetris_features){
+      .max_height = tetris_get_max_height(pgame),
+      .holes = tetris_get_holes(pgame),
+    };
+    for (int x = 0; x < TETRIS_MAX_COLUMNS; x++) {
+      pf->height += tetris_get_height(pgame, x);
+      if (x > 0)
+        pf->bumpiness += abs(tetris_get_height(pgame, x) -
+                             tetris_get_height(pgame, x - 1));
+    }
+
+    tetris_restore(pgame, snapshot);
+  }
+
+  tetris_eval(pc->boards, n, pc->features);
+  pc->boards_evaluated += n;
+
+  for (size_t i = 0; i < n; i++) {
+    const struct tetris_features *got = &pc->features[i],
+                                 *want = &pc->metrics[i];
+    if (got->height != want->height || got->max_height != want->max_height ||
+        got->holes != want->holes || got->bumpiness != want->bumpiness)
+      return -1;
+  }
+
+  return n;
+}
+
+/* The number of ways to lock the next depth blocks */
+static uint64_t
+perft(struct perft* pp, tetris* pgame, int depth)
+{
+  struct tetris_move* moves = &pp->moves[(depth - 1) * PERFT_MAX_MOVES];
+  size_t n = tetris_moves(pgame, moves, PERFT_MAX_MOVES, pp->hold);
+
+  if (pp->check && check_moves(pp->check, pgame) == -1) {
+    fprintf(stderr, "Moves of block %d differ from the search after %u\n",
+            CURRENT_BLOCK(pgame)->type, tetris_get_pieces(pgame));
+    exit(EXIT_FAILURE);
+  }
+
+  if (pp->check && check_eval(pp->check, pgame, moves, n) == -1) {
+    fprintf(stderr, "Evaluation differs from the game's metrics after %u\n",
+            tetris_get_pieces(pgame));
+    exit(EXIT_FAILURE);
+  }
+
+  if (depth == 1 && pp->bulk)
+    return n;
+
+  unsigned char snapshot[TETRIS_SNAPSHOT_SIZE];
+  tetris_snapshot(pgame, snapshot);
+
+  uint64_t nodes = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (tetris_place_move(pgame, &moves[i]) != 1) {
+      fprintf(stderr, "Move %zu of %zu didn't place\n", i, n);
+      exit(EXIT_FAILURE);
+    }
+
+    nodes += depth == 1 ? 1 : perft(pp, pgame, depth - 1);
+    tetris_restore(pgame, snapshot);
+  }
+
+  return nodes;
+}
+
+/* Start the game at a position, returns -1 when it doesn't fit the board */
+static int
+position_setup(tetris* pgame, const struct position* pos, uint64_t seed)
+{
+  tetris_row rows[PERFT_ROWS];
+  size_t n = 0;
+
+  while (n < PERFT_ROWS && pos->rows[n]) {
+    const char* s = pos->rows[n];
+    if (n >= TETRIS_MAX_ROWS || strlen(s) > TETRIS_MAX_COLUMNS)
+      return -1;
+
+    rows[n] = 0;
+    for (size_t x = 0; s[x]; x++)
+      if (s[x] == '#')
+        rows[n] |= (tetris_row)1 << x;
+    n++;
+  }
+
+  tetris_reset(pgame);
+  tetris_set_seed(pgame, seed);
+
+  return tetris_set_rows(pgame, TETRIS_MAX_ROWS - n, rows, n);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct perft pp = { .bulk = true };
+  const char* only = NULL;
+  uint64_t seed = 0;
+  bool seeded = false;
+  long depth = 4;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "bcd:hp:s:u")) != -1) {
+    switch (ch) {
+      case 'b':
+        pp.bulk = false;
+        break;
+      case 'c':
+        pp.check = malloc(sizeof *pp.check);
+        if (!pp.check)
+          exit(EXIT_FAILURE);
+        pp.check->positions = 0;
+        pp.check->boards_evaluated = 0;
+        break;
+      case 'd':
+        depth = strtol(optarg, NULL, 10);
+        break;
+      case 'h':
+        pp.hold = true;
+        break;
+      case 'p':
+        only = optarg;
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        seeded = true;
+        break;
+      case 'u':
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (depth < 1 || depth > 64) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  /* The known counts are for the standard game only */
+  bool check = !pp.hold && !seeded && TETRIS_MAX_COLUMNS == 10 &&
+               TETRIS_MAX_ROWS == 22;
+
+  tetris* pgame;
+  pp.moves = malloc(depth * PERFT_MAX_MOVES * sizeof *pp.moves);
+  if (!pp.moves || tetris_init(&pgame) != 1)
+    exit(EXIT_FAILURE);
+
+  tetris_set_gamemode(pgame, TETRIS_INFINITY);
+
+  uint64_t total = 0;
+  double total_secs = 0;
+  int failed = 0, ran = 0;
+
+  for (size_t i = 0; i < NUM_POSITIONS; i++) {
+    const struct position* pos = &positions[i];
+    if (only && strcmp(only, pos->name))
+      continue;
+
+    ran++;
+    if (position_setup(pgame, pos, seeded ? seed : pos->seed) != 1) {
+      printf("%-8s doesn't fit the board\n", pos->name);
+      continue;
+    }
+
+    for (int d = 1; d <= depth; d++) {
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      uint64_t nodes = perft(&pp, pgame, d);
+      double secs = elapsed(&start);
+
+      total += nodes;
+      total_secs += secs;
+
+      printf("%-8s depth %2d %14llu nodes %9.3fs %12.0f nodes/s", pos->name,
+             d, (unsigned long long)nodes, secs, nodes / secs);
+
+      if (check && d <= PERFT_KNOWN) {
+        if (nodes == pos->nodes[d - 1])
+          printf("  ok");
+        else {
+          printf("  FAIL, expected %llu",
+                 (unsigned long long)pos->nodes[d - 1]);
+          failed++;
+        }
+      }
+      printf("\n");
+    }
+  }
+
+  if (!ran) {
+    fprintf(stderr, "No position named %s\n", only);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("\n%llu nodes in %.3fs, %.0f nodes/s\n", (unsigned long long)total,
+         total_secs, total / total_secs);
+  if (pp.check)
+    printf("%llu positions checked, %llu boards evaluated\n",
+           (unsigned long long)pp.check->positions,
+           (unsigned long long)pp.check->boards_evaluated);
+
+  free(pp.check);
+  free(pp.moves);
+  tetris_cleanup(pgame);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
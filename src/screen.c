@@ -120,15 +120,50 @@ screen_menu(tetris* pgame)
   return 1;
 }
 
+/* Turn the events since the last update into messages */
+static void
+screen_events(struct session* ps)
+{
+  struct tetris_event ev;
+
+  while (tetris_events_pop(&ps->events, &ev) == 1) {
+    switch (ev.type) {
+      case TETRIS_EVENT_LINES:
+        if (ev.arg == 4)
+          logs_to_game(&ps->messages, "Tetris!");
+        break;
+      case TETRIS_EVENT_T_SPIN:
+        logs_to_game(&ps->messages, "T spin!");
+        break;
+      case TETRIS_EVENT_T_SPIN_MINI:
+        logs_to_game(&ps->messages, "Mini T spin!");
+        break;
+      case TETRIS_EVENT_LEVEL_UP:
+        logs_to_game(&ps->messages, "Level up! Speed up!");
+        break;
+      case TETRIS_EVENT_HOLD:
+        if (ev.arg == 0)
+          logs_to_game(&ps->messages, "Block has already been held.");
+        break;
+    }
+  }
+}
+
 int
-screen_update(tetris* pgame)
+screen_update(struct session* ps)
 {
+  tetris* pgame = ps->game;
+  const struct config* config = ps->config;
+
+  screen_events(ps);
+
   werase(board);
   werase(pieces);
   werase(text);
 
   size_t i;
   const block* pblock;
+  const struct tetris_shape* shape;
 
   /***************/
   /* draw pieces */
@@ -137,37 +172,38 @@ screen_update(tetris* pgame)
   wattrset(pieces, COLOR_PAIR(SCREEN_COLOR_WHITE));
   box(pieces, 0, 0);
 
-  pblock = HOLD_BLOCK(pgame);
-
-  wattrset(pieces, A_BOLD | COLOR_PAIR((pblock->type % SCREEN_NUM_COLORS) + 1));
+  /* Hold box, empty until the first block is held */
+  if (tetris_get_hold(pgame)) {
+    uint8_t type = tetris_get_hold(pgame);
+    shape = &tetris_shapes[type][0];
 
-  for (i = 0; i < LEN(pblock->p); i++) {
+    wattrset(pieces, A_BOLD | COLOR_PAIR((type % SCREEN_NUM_COLORS) + 1));
+    for (i = 0; i < LEN(shape->p); i++) {
 #if defined(WIDE_NCURSES)
-    mvwadd_wch(pieces, pblock->p[i].y + 2, pblock->p[i].x + 3, BLOCK_CHAR);
+      mvwadd_wch(pieces, shape->p[i].y + 2, shape->p[i].x + 3, BLOCK_CHAR);
 #else
-    mvwaddch(pieces, pblock->p[i].y + 2, pblock->p[i].x + 3, BLOCK_CHAR);
+      mvwaddch(pieces, shape->p[i].y + 2, shape->p[i].x + 3, BLOCK_CHAR);
 #endif
+    }
   }
 
-  pblock = FIRST_NEXT_BLOCK(pgame);
+  /* As many "next" blocks as fit in the window */
+  for (size_t count = 0; count < tetris_get_next_len(pgame) &&
+                         count < (PIECES_HEIGHT - 1) / 3;
+       count++) {
+    uint8_t type = tetris_get_next(pgame, count);
+    shape = &tetris_shapes[type][0];
 
-  size_t count = 0;
-  while (pblock) {
-
-    wattrset(pieces,
-             A_BOLD | COLOR_PAIR((pblock->type % SCREEN_NUM_COLORS) + 1));
-    for (i = 0; i < LEN(pblock->p); i++) {
+    wattrset(pieces, A_BOLD | COLOR_PAIR((type % SCREEN_NUM_COLORS) + 1));
+    for (i = 0; i < LEN(shape->p); i++) {
 #if defined(WIDE_NCURSES)
-      mvwadd_wch(pieces, pblock->p[i].y + 2 + (count * 3), pblock->p[i].x + 9,
+      mvwadd_wch(pieces, shape->p[i].y + 2 + (count * 3), shape->p[i].x + 9,
                  BLOCK_CHAR);
 #else
-      mvwaddch(pieces, pblock->p[i].y + 2 + (count * 3), pblock->p[i].x + 9,
+      mvwaddch(pieces, shape->p[i].y + 2 + (count * 3), shape->p[i].x + 9,
                BLOCK_CHAR);
 #endif
     }
-
-    count++;
-    pblock = pblock->entries.le_next;
   }
 
   /**************/
@@ -183,17 +219,20 @@ screen_update(tetris* pgame)
   mvwhline(board, TETRIS_MAX_ROWS - 2, 0, '*', TETRIS_MAX_COLUMNS + 2);
 
   /* Draw the ghost block */
-  pblock = pgame->ghost_block;
-  wattrset(board, A_DIM | COLOR_PAIR((pblock->type % SCREEN_NUM_COLORS) + 1));
+  if ((pblock = tetris_get_ghost_block(pgame)) != NULL) {
+    shape = tetris_block_shape(pblock);
+    wattrset(board,
+             A_DIM | COLOR_PAIR((pblock->type % SCREEN_NUM_COLORS) + 1));
 
-  for (i = 0; i < LEN(pblock->p); i++) {
+    for (i = 0; i < LEN(shape->p); i++) {
 #if defined(WIDE_NCURSES)
-    mvwadd_wch(board, pblock->p[i].y + pblock->row_off - 2,
-               pblock->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
+      mvwadd_wch(board, shape->p[i].y + pblock->row_off - 2,
+                 shape->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
 #else
-    mvwaddch(board, pblock->p[i].y + pblock->row_off - 2,
-             pblock->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
+      mvwaddch(board, shape->p[i].y + pblock->row_off - 2,
+               shape->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
 #endif
+    }
   }
 
   /* Draw the game board, minus the two hidden rows above the game */
@@ -219,16 +258,17 @@ screen_update(tetris* pgame)
 
   /* Draw the falling block to the board */
   pblock = CURRENT_BLOCK(pgame);
-  for (i = 0; i < LEN(pblock->p); i++) {
+  shape = tetris_block_shape(pblock);
+  for (i = 0; i < LEN(shape->p); i++) {
     wattrset(board,
              A_BOLD | COLOR_PAIR((pblock->type % SCREEN_NUM_COLORS) + 1));
 
 #if defined(WIDE_NCURSES)
-    mvwadd_wch(board, pblock->p[i].y + pblock->row_off - 2,
-               pblock->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
+    mvwadd_wch(board, shape->p[i].y + pblock->row_off - 2,
+               shape->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
 #else
-    mvwaddch(board, pblock->p[i].y + pblock->row_off - 2,
-             pblock->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
+    mvwaddch(board, shape->p[i].y + pblock->row_off - 2,
+             shape->p[i].x + pblock->col_off + 1, BLOCK_CHAR);
 #endif
   }
 
@@ -238,9 +278,10 @@ screen_update(tetris* pgame)
     mvwprintw(board, (BOARD_HEIGHT - 1) / 2, (BOARD_WIDTH - 6) / 2, "PAUSED");
   }
 
+  const char* gamemode = tetris_get_gamemode_name(pgame);
   wattrset(board, COLOR_PAIR(SCREEN_COLOR_BLUE));
-  mvwprintw(board, BOARD_HEIGHT - 1,
-            (BOARD_WIDTH - strlen(pgame->gamemode)) / 2, "%s", pgame->gamemode);
+  mvwprintw(board, BOARD_HEIGHT - 1, (BOARD_WIDTH - strlen(gamemode)) / 2,
+            "%s", gamemode);
 
   /******************/
   /* Draw game text */
@@ -251,15 +292,13 @@ screen_update(tetris* pgame)
   mvwprintw(text, 2, 2, "Score %7d", tetris_get_score(pgame));
   mvwprintw(text, 3, 2, "Lines %7d", tetris_get_lines(pgame));
   mvwprintw(text, 4, 2, "Difficult %3d", tetris_get_difficult(pgame));
-  mvwprintw(text, 5, 2, "%s", pgame->id); // username
+  mvwprintw(text, 5, 2, "%s", ps->id); // username
 #ifdef DEBUG
   mvwprintw(text, 6, 2, "DEBUG");
 #endif
 
   /* Controls */
   {
-    extern struct config* config;
-
     mvwprintw(text, 1, 22, "Pause: %c", config->pause_key.key);
     mvwprintw(text, 2, 22, "Save/Quit: %c", config->quit_key.key);
     mvwprintw(text, 3, 22, "Move: %c%c%c%c", config->move_drop.key,
@@ -301,7 +340,7 @@ screen_update(tetris* pgame)
   i = 0;
   int vert_off = 11;
 
-  LIST_FOREACH(lep, &entry_head, entries)
+  LIST_FOREACH(lep, &ps->messages, entries)
   {
     /* Display messages, then remove anything that can't fit on
      * screen
@@ -328,8 +367,10 @@ screen_update(tetris* pgame)
 
 /* Game over screen */
 int
-screen_gameover(tetris* pgame)
+screen_gameover(struct session* ps)
 {
+  tetris* pgame = ps->game;
+
   debug("Drawing game over screen");
 
   clear();
@@ -349,15 +390,16 @@ screen_gameover(tetris* pgame)
   mvprintw(2, 3, "Rank\tName\t\tLevel\t  Score\t\tDate");
 
   /* Print score board when you lose a game */
-  tetris* res[20];
+  struct db_score res[20];
+  int res_len;
 
   /* Get LEN top scores from database */
-  if (db_get_scores(pgame, res, LEN(res)) != 1) {
+  if ((res_len = db_get_scores(ps, res, LEN(res))) < 0) {
     return 0;
   }
 
-  for (size_t i = 0; i < LEN(res) && res[i]; i++) {
-    char* date_str = ctime(&((res[i])->date));
+  for (int i = 0; i < res_len; i++) {
+    char* date_str = ctime(&res[i].date);
 
     /* Pretty colors for 1st, 2nd, 3rd, and 4th */
     switch (i) {
@@ -383,8 +425,8 @@ screen_gameover(tetris* pgame)
 
     /* Bold the entry we've just added to the highscores */
     bool us;
-    if ((tetris_get_score(pgame) == (res[i])->score) &&
-        (tetris_get_level(pgame) == (res[i])->level)) {
+    if ((tetris_get_score(pgame) == res[i].score) &&
+        (tetris_get_level(pgame) == res[i].level)) {
       attron(A_BOLD);
       us = true;
     } else {
@@ -393,12 +435,10 @@ screen_gameover(tetris* pgame)
     }
 
     mvprintw(i + 3, 2, "%s%2d.\t%-16s%5d\t%7d\t\t%.*s%s", us ? ">>" : "  ",
-             i + 1, (res[i])->id, (res[i])->level, (res[i])->score,
+             i + 1, res[i].id, res[i].level, res[i].score,
              strlen(date_str) - 1, date_str, us ? " <<" : "");
   }
 
-  db_clean_scores(res, LEN(res));
-
 input_wait:
   /* Give a 5 second countdown before the user can quit, so they have
    * time to see highscores. And so they don't accidentally quit while
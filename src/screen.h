@@ -20,10 +20,11 @@
 
 #include <ncurses.h>
 
+#include "session.h"
 #include "tetris.h"
 
 int screen_init(void);
 void screen_cleanup(void);
 int screen_menu(tetris*);
-int screen_update(tetris*);
-int screen_gameover(tetris*);
+int screen_update(struct session*);
+int screen_gameover(struct session*);
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2014  James Smith <james@apertum.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include "conf.h"
+#include "logs.h"
+#include "tetris.h"
+
+/* Everything the frontend needs to run one game. It's passed to the event
+ * callbacks and screen functions, rather than kept in globals.
+ */
+struct session
+{
+  tetris* game;
+  struct config* config;
+  struct log_entry_head messages; // In-game messages, newest first
+
+  /* Game events, turned into messages by screen_update() */
+  struct tetris_events events;
+  struct tetris_event event_buf[32];
+
+  char id[16];       // Player name
+  char db_file[256]; // Scores and saved games
+};
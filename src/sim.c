@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2014  James Smith <james@apertum.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Headless game runner. Plays seeded games on every core, a policy choosing
+ * where each block goes, and reports how fast they ran. There's no terminal,
+ * database or logs, only the engine.
+ *
+ * Each worker thread starts with an even share of the games, as a range of
+ * game numbers. A worker that runs out steals the top half of another
+ * worker's range. Ranges are a single atomic word, so taking a game and
+ * stealing are both one compare and swap, and nothing ever waits on a lock.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "tetris.h"
+
+struct placement
+{
+  uint8_t rotation;
+  int8_t column;
+  bool hold;
+};
+
+struct worker;
+
+/* Place the current block, returns -1 when it can't be placed */
+typedef int (*policy)(tetris*, struct worker*);
+
+/* Settings and results shared by the workers */
+struct sim
+{
+  uint64_t seed;       // Seed of the first game, each game after adds 1
+  uint32_t games;
+  uint32_t max_pieces; // Blocks per game, 0 plays until the game is over
+  enum TETRIS_GAMES gamemode;
+  policy play;
+
+  /* Scripted policy, the placements are used over and over */
+  struct placement* script;
+  size_t script_len;
+
+  struct worker* workers;
+  size_t num_workers;
+
+  uint32_t* scores; // By game number, written by the worker playing it
+};
+
+struct worker
+{
+  /* Games left to play, first << 32 | end. Kept on a cache line of its own,
+   * it's the only thing other workers touch. */
+  _Alignas(64) _Atomic uint64_t range;
+  char pad[64 - sizeof(_Atomic uint64_t)];
+
+  const struct sim* sim;
+  pthread_t thread;
+
+  uint64_t rng;      // Random policy
+  size_t script_pos; // Scripted policy
+
+  uint64_t pieces, lines;
+};
+
+#define RANGE(FIRST, END) ((uint64_t)(FIRST) << 32 | (END))
+
+static void
+usage(void)
+{
+  extern const char* __progname;
+
+  fprintf(stderr,
+          "%s version %s\n\n"
+          "Usage:\n\t"
+          "[-u] usage\n\t"
+          "[-n games] number of games to play, 100\n\t"
+          "[-j threads] worker threads, one per core by default\n\t"
+          "[-s seed] seed of the first game, 1\n\t"
+          "[-l pieces] blocks per game, 1000, 0 plays until the game\n\t\t"
+          "is over, which the heuristic policy never is\n\t"
+          "[-m mode] classic, 40lines or infinity\n\t"
+          "[-p policy] random, heuristic or script\n\t"
+          "[-f file] placements for the script policy, one\n\t\t"
+          "\"rotation column [h]\" per line\n\n",
+          __progname, VERSION);
+}
+
+/* xorshift64*, so the random policy doesn't disturb the games' blocks */
+static uint32_t
+sim_random(struct worker* pw)
+{
+  pw->rng ^= pw->rng >> 12;
+  pw->rng ^= pw->rng << 25;
+  pw->rng ^= pw->rng >> 27;
+  return (pw->rng * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+/* Random rotations and columns until a block fits */
+static int
+policy_random(tetris* pgame, struct worker* pw)
+{
+  for (int tries = 0; tries < 8 * TETRIS_MAX_COLUMNS; tries++) {
+    uint32_t r = sim_random(pw);
+    int column = (r >> 2) % TETRIS_MAX_COLUMNS;
+
+    if (tetris_place(pgame, r & 3, column, false) == 1)
+      return 1;
+  }
+
+  return -1;
+}
+
+/* The placements from the script file in order, skipping those that don't
+ * fit */
+static int
+policy_script(tetris* pgame, struct worker* pw)
+{
+  const struct sim* ps = pw->sim;
+
+  for (size_t tries = 0; tries < ps->script_len; tries++) {
+    const struct placement* pp = &ps->script[pw->script_pos++];
+    if (pw->script_pos == ps->script_len)
+      pw->script_pos = 0;
+
+    if (tetris_place(pgame, pp->rotation, pp->column, pp->hold) == 1)
+      return 1;
+  }
+
+  return -1;
+}
+
+/* Score a board after a placement, the weights were found by a genetic
+ * algorithm for a well known Tetris AI */
+static double
+heuristic_eval(const tetris* pgame, uint32_t lines)
+{
+  int aggregate = 0, bumpiness = 0;
+
+  for (int x = 0; x < TETRIS_MAX_COLUMNS; x++) {
+    aggregate += tetris_get_height(pgame, x);
+    if (x > 0)
+      bumpiness +=
+        abs(tetris_get_height(pgame, x) - tetris_get_height(pgame, x - 1));
+  }
+
+  return -0.510066 * aggregate + 0.760666 * lines -
+         0.35663 * tetris_get_holes(pgame) - 0.184483 * bumpiness;
+}
+
+/* Try every rotation and column, with and without the hold box, and place
+ * the block where the board looks best */
+static int
+policy_heuristic(tetris* pgame, struct worker* pw)
+{
+  (void)pw;
+
+  unsigned char snapshot[TETRIS_SNAPSHOT_SIZE];
+  tetris_snapshot(pgame, snapshot);
+
+  uint32_t lines = tetris_get_lines(pgame);
+  struct placement best = { 0, 0, false };
+  double best_eval = 0;
+  bool found = false;
+
+  for (int hold = 0; hold < 2; hold++) {
+    for (int rotation = 0; rotation < 4; rotation++) {
+      /* An I block's pivot can be just off the board */
+      for (int column = -1; column <= TETRIS_MAX_COLUMNS; column++) {
+        if (tetris_place(pgame, rotation, column, hold) != 1)
+          continue;
+
+        uint32_t cleared = tetris_get_lines(pgame) - lines;
+        double eval = tetris_get_state(pgame) == TETRIS_LOSE
+                        ? -1e9
+                        : heuristic_eval(pgame, cleared);
+        tetris_restore(pgame, snapshot);
+
+        if (!found || eval > best_eval) {
+          best = (struct placement){ rotation, column, hold };
+          best_eval = eval;
+          found = true;
+        }
+      }
+    }
+  }
+
+  if (!found)
+    return -1;
+
+  return tetris_place(pgame, best.rotation, best.column, best.hold);
+}
+
+/* Read "rotation column [h]" lines, returns the number of placements or -1 */
+static int
+script_load(struct sim* ps, const char* file)
+{
+  FILE* fp = fopen(file, "r");
+  if (!fp) {
+    perror(file);
+    return -1;
+  }
+
+  char line[64];
+  size_t cap = 0;
+
+  while (fgets(line, sizeof line, fp)) {
+    int rotation, column;
+    char hold = 0;
+
+    if (sscanf(line, "%d %d %c", &rotation, &column, &hold) < 2)
+      continue;
+
+    if (ps->script_len == cap) {
+      cap = cap ? cap * 2 : 64;
+      struct placement* script = realloc(ps->script, cap * sizeof *script);
+      if (!script) {
+        fclose(fp);
+        return -1;
+      }
+      ps->script = script;
+    }
+
+    ps->script[ps->script_len++] = (struct placement){
+      rotation & 3, column, hold == 'h',
+    };
+  }
+
+  fclose(fp);
+
+  return ps->script_len ? (int)ps->script_len : -1;
+}
+
+/* Take the next game from our own range */
+static bool
+worker_take(struct worker* pw, uint32_t* game)
+{
+  uint64_t range = atomic_load(&pw->range);
+  uint32_t first, end;
+
+  do {
+    first = range >> 32;
+    end = (uint32_t)range;
+    if (first >= end)
+      return false;
+  } while (!atomic_compare_exchange_weak(&pw->range, &range,
+                                         RANGE(first + 1, end)));
+
+  *game = first;
+  return true;
+}
+
+/* Our range is empty, take the top half of the next worker's range that
+ * isn't */
+static bool
+worker_steal(struct worker* pw)
+{
+  const struct sim* ps = pw->sim;
+  size_t self = pw - ps->workers;
+
+  for (size_t i = 1; i < ps->num_workers; i++) {
+    struct worker* victim = &ps->workers[(self + i) % ps->num_workers];
+    uint64_t range = atomic_load(&victim->range);
+
+    for (;;) {
+      uint32_t first = range >> 32, end = (uint32_t)range;
+      if (first >= end)
+        break;
+
+      uint32_t half = first + (end - first) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &range,
+                                       RANGE(first, half))) {
+        atomic_store(&pw->range, RANGE(half, end));
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/* Play game number n to the end, or to the piece limit */
+static void
+worker_play(struct worker* pw, tetris* pgame, uint32_t n)
+{
+  const struct sim* ps = pw->sim;
+
+  tetris_set_gamemode(pgame, ps->gamemode);
+  tetris_set_seed(pgame, ps->seed + n);
+  pw->rng = ps->seed + n;
+  pw->script_pos = 0;
+
+  while (ps->max_pieces == 0 || tetris_get_pieces(pgame) < ps->max_pieces)
+    if (ps->play(pgame, pw) < 0)
+      break;
+
+  ps->scores[n] = tetris_get_score(pgame);
+  pw->pieces += tetris_get_pieces(pgame);
+  pw->lines += tetris_get_lines(pgame);
+}
+
+/* Each worker takes its games from a pool of its own, made on its own
+ * thread, so a game is allocated once and recycled after that */
+static void*
+worker_run(void* arg)
+{
+  struct worker* pw = arg;
+  tetris_pool pool;
+
+  /* Its games would be counted as played with no score */
+  if (tetris_pool_init(&pool, 1) != 1) {
+    fprintf(stderr, "Out of memory for a worker's games\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t n;
+  do {
+    while (worker_take(pw, &n)) {
+      tetris* pgame = tetris_pool_get(&pool);
+      worker_play(pw, pgame, n);
+      tetris_pool_put(&pool, pgame);
+    }
+  } while (worker_steal(pw));
+
+  tetris_pool_cleanup(&pool);
+
+  return NULL;
+}
+
+static int
+cmp_scores(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct sim sim = {
+    .seed = 1,
+    .games = 100,
+    .max_pieces = 1000,
+    .gamemode = TETRIS_INFINITY,
+    .play = policy_random,
+  };
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* script_file = NULL;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "f:j:l:m:n:p:s:u")) != -1) {
+    switch (ch) {
+      case 'f':
+        script_file = optarg;
+        break;
+      case 'j':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      case 'l':
+        sim.max_pieces = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        if (!strcmp(optarg, "classic"))
+          sim.gamemode = TETRIS_CLASSIC;
+        else if (!strcmp(optarg, "40lines"))
+          sim.gamemode = TETRIS_40_LINES;
+        else if (!strcmp(optarg, "infinity"))
+          sim.gamemode = TETRIS_INFINITY;
+        else {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'n':
+        sim.games = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        if (!strcmp(optarg, "random"))
+          sim.play = policy_random;
+        else if (!strcmp(optarg, "heuristic"))
+          sim.play = policy_heuristic;
+        else if (!strcmp(optarg, "script"))
+          sim.play = policy_script;
+        else {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 's':
+        sim.seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'u':
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (sim.games == 0 || threads < 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  if (sim.play == policy_heuristic && sim.max_pieces == 0) {
+    fprintf(stderr, "The heuristic policy never loses, it needs a piece "
+                    "limit\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (sim.play == policy_script &&
+      (!script_file || script_load(&sim, script_file) < 0)) {
+    fprintf(stderr, "The script policy needs a file of placements\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* More workers than games would only have nothing to do */
+  sim.num_workers = (size_t)threads < sim.games ? (size_t)threads : sim.games;
+  sim.workers = aligned_alloc(_Alignof(struct worker),
+                              sim.num_workers * sizeof *sim.workers);
+  sim.scores = calloc(sim.games, sizeof *sim.scores);
+  if (!sim.workers || !sim.scores)
+    exit(EXIT_FAILURE);
+
+  /* An even share of the games each to start with */
+  for (size_t i = 0; i < sim.num_workers; i++) {
+    struct worker* pw = &sim.workers[i];
+    memset(pw, 0, sizeof *pw);
+    pw->sim = &sim;
+    atomic_init(&pw->range, RANGE(sim.games * i / sim.num_workers,
+                                  sim.games * (i + 1) / sim.num_workers));
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t i = 0; i < sim.num_workers; i++) {
+    if (pthread_create(&sim.workers[i].thread, NULL, worker_run,
+                       &sim.workers[i]) != 0) {
+      perror("pthread_create()");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (size_t i = 0; i < sim.num_workers; i++)
+    pthread_join(sim.workers[i].thread, NULL);
+
+  double secs = elapsed(&start);
+
+  /* The workers are done, their results can be read without locks */
+  uint64_t pieces = 0, lines = 0;
+  for (size_t i = 0; i < sim.num_workers; i++) {
+    pieces += sim.workers[i].pieces;
+    lines += sim.workers[i].lines;
+  }
+
+  uint32_t* scores = sim.scores;
+  qsort(scores, sim.games, sizeof *scores, cmp_scores);
+  uint64_t total = 0;
+  for (size_t i = 0; i < sim.games; i++)
+    total += scores[i];
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%u games on %zu threads, %llu pieces, %llu lines in %.3fs\n",
+         sim.games, sim.num_workers, (unsigned long long)pieces,
+         (unsigned long long)lines, secs);
+  printf("%.1f games/s, %.0f pieces/s\n", sim.games / secs, pieces / secs);
+  printf("score min %u, median %u, mean %.1f, p90 %u, max %u\n", scores[0],
+         scores[sim.games / 2], (double)total / sim.games,
+         scores[sim.games * 9 / 10], scores[sim.games - 1]);
+  printf("peak RSS %ld KB\n", usage.ru_maxrss);
+
+  free(sim.workers);
+  free(sim.scores);
+  free(sim.script);
+
+  return 0;
+}
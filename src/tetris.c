@@ -16,21 +16,95 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <assert.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/queue.h>
+#include <time.h>
 
 #include "helpers.h"
-#include "logs.h"
 #include "tetris.h"
 
+/* Memory and logging hooks, see tetris_set_hooks(). Only written by
+ * tetris_set_hooks(), games just read them, so games on other threads
+ * never share mutable state.
+ */
+static struct tetris_hooks hooks = {
+  .alloc = malloc, .free = free, .log = NULL,
+};
+
+#define tetris_log(G, L, M)                                                    \
+  do {                                                                         \
+    if (hooks.log)                                                             \
+      hooks.log((G), (L), (M));                                                \
+  } while (0)
+
+/* Bit counts of board rows and columns, which may be wider than an int */
+#define BIT_CTZ(V)                                                             \
+  (sizeof(V) > sizeof(unsigned) ? __builtin_ctzll(V) : __builtin_ctz(V))
+#define BIT_COUNT(V)                                                           \
+  (sizeof(V) > sizeof(unsigned) ? __builtin_popcountll(V)                      \
+                                : __builtin_popcount(V))
+
+/* Every column of a row set */
+#define FULL_ROW ((tetris_row)-1 >> (sizeof(tetris_row) * 8 - TETRIS_MAX_COLUMNS))
+
 /****************************/
 /*  Begin Random Generator  */
 /****************************/
 
 #define DIRTY_BIT 0x80
 
+/* PCG32 with a fixed increment: 64 bits of state per game, so games never
+ * share a sequence and the same seed always deals the same blocks.
+ */
+#define PCG_MULT 6364136223846793005ULL
+#define PCG_INC 1442695040888963407ULL
+
+static uint32_t
+random_next(tetris* pgame)
+{
+  uint64_t old = pgame->rng_state;
+  pgame->rng_state = old * PCG_MULT + PCG_INC;
+
+  uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+  uint32_t rot = old >> 59;
+  return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+static void
+random_seed(tetris* pgame, uint64_t seed)
+{
+  pgame->rng_state = 0;
+  random_next(pgame);
+  pgame->rng_state += seed;
+  random_next(pgame);
+}
+
+/* A seed for a new game, from nothing but the game itself. The time alone
+ * is the same for every game started in the same second, so the nanoseconds
+ * and the game's address are mixed in, which differ between games started
+ * together on any thread. */
+static uint64_t
+random_init_seed(const tetris* pgame)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  return ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^
+         (uint64_t)(uintptr_t)pgame * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Uniform number in [0, n), without a division */
+static uint32_t
+random_below(tetris* pgame, uint32_t n)
+{
+  return ((uint64_t)random_next(pgame) * n) >> 32;
+}
+#undef PCG_MULT
+#undef PCG_INC
+
 /* This is the "Random Generator" algorithm.
  * Create a 'bag' of all seven pieces, then one by one remove an element from
  * the bag. Refill the bag when it's empty.
@@ -55,7 +129,7 @@ bag_random_generator(tetris* pgame)
    * From the Tetris Guidlines:
    * 	First piece is never the O, S, or Z blocks.
    */
-  index = random() % (LEN(pgame->bag) - 3); // [0, 3]
+  index = random_below(pgame, LEN(pgame->bag) - 3); // [0, 3]
   pgame->bag[0] = avail_blocks[index];
   avail_blocks[index] = DIRTY_BIT;
 
@@ -72,7 +146,7 @@ bag_random_generator(tetris* pgame)
    */
   for (uint8_t i = 1; i < LEN(pgame->bag); i++) {
 
-    index = random() % (LEN(pgame->bag) - i) + 1;
+    index = random_below(pgame, LEN(pgame->bag) - i) + 1;
 
     size_t get_elm = 0;
 
@@ -83,118 +157,265 @@ bag_random_generator(tetris* pgame)
     pgame->bag[i] = avail_blocks[get_elm - 1];
     avail_blocks[get_elm - 1] = DIRTY_BIT;
   }
+
+  pgame->bag_index = 0;
 }
 
 static int
 bag_next_piece(tetris* pgame)
 {
-  static size_t index = 0;
+  return pgame->bag[pgame->bag_index++];
+}
+
+static int
+bag_is_empty(tetris* pgame)
+{
+  return pgame->bag_index >= LEN(pgame->bag);
+}
+#undef DIRTY_BIT
+
+/**************************/
+/*  End Random Generator  */
+/**************************/
 
-  int ret = pgame->bag[index];
+/****************************/
+/*       Begin Events       */
+/****************************/
 
-  /* Mark bag location dirty */
-  pgame->bag[index++] |= DIRTY_BIT;
+/* Append an event, overwriting the oldest if the buffer is full */
+static inline void
+event_push(tetris* pgame, uint8_t type, uint8_t block_type, uint16_t arg)
+{
+  struct tetris_events* pev = pgame->events;
+  if (!pev)
+    return;
 
-  if (index >= LEN(pgame->bag))
-    index = 0;
+  if (pev->tail - pev->head >= pev->size) {
+    pev->head++;
+    pev->lost++;
+  }
 
-  return ret;
+  struct tetris_event* ev = &pev->buf[pev->tail++ & (pev->size - 1)];
+  ev->type = type;
+  ev->block = block_type;
+  ev->arg = arg;
 }
 
-static int
-bag_is_empty(tetris* pgame)
+/**************************/
+/*       End Events       */
+/**************************/
+
+/**************************/
+/*       Begin Undo       */
+/**************************/
+
+/* Save the game as the new block spawns, dropping the oldest snapshot if the
+ * stack is full */
+static void
+undo_push(tetris* pgame)
 {
-  for (size_t i = 0; i < LEN(pgame->bag); i++)
-    if (pgame->bag[i] < DIRTY_BIT)
-      return 0;
+  struct tetris_undo* pu = pgame->undo;
+  if (!pu)
+    return;
 
-  return 1;
+  size_t slot = pu->top++ & (pu->size - 1);
+  memcpy(pu->buf + slot * TETRIS_SNAPSHOT_SIZE, pgame, TETRIS_SNAPSHOT_SIZE);
+
+  if (pu->len < pu->size)
+    pu->len++;
 }
-#undef DIRTY_BIT
 
 /**************************/
-/*  End Random Generator  */
+/*        End Undo        */
 /**************************/
 
 /**********************************/
 /* Begin Private helper functions */
 /**********************************/
 
+/* The "next" blocks are a ring buffer, TETRIS_NEXT_BLOCKS_MAX is a power of 2 */
+#define NEXT_BLOCKS_MASK (TETRIS_NEXT_BLOCKS_MAX - 1)
+
+/* The pieces of each block rotate around the pivot at (0, 0). Each
+ * rotation to the right maps a piece at (x, y) to (-y, x). The I block turns
+ * around the corner between its two middle pieces, (x, y) to (1 - y, x), as
+ * in the Super Rotation System. The O block doesn't rotate.
+ */
+const struct tetris_shape tetris_shapes[TETRIS_NUM_BLOCKS + 1][4] = {
+  /* No block */
+  { { { 0 }, 0, 0, 0, 0, { 0 }, { { 0, 0 } } } },
+  /* I */
+  {
+    { { 0xf, 0x0, 0x0, 0x0 }, -1, 0, 4, 1, { 0, 0, 0, 0 },
+      { { 0, 0 }, { -1, 0 }, { 1, 0 }, { 2, 0 } } },
+    { { 0x1, 0x1, 0x1, 0x1 }, 1, -1, 1, 4, { 3, 0, 0, 0 },
+      { { 1, 0 }, { 1, -1 }, { 1, 1 }, { 1, 2 } } },
+    { { 0xf, 0x0, 0x0, 0x0 }, -1, 1, 4, 1, { 0, 0, 0, 0 },
+      { { 0, 1 }, { 1, 1 }, { -1, 1 }, { 2, 1 } } },
+    { { 0x1, 0x1, 0x1, 0x1 }, 0, -1, 1, 4, { 3, 0, 0, 0 },
+      { { 0, 0 }, { 0, 1 }, { 0, -1 }, { 0, 2 } } },
+  },
+  /* T */
+  {
+    { { 0x2, 0x7, 0x0, 0x0 }, -1, -1, 3, 2, { 1, 1, 1, 0 },
+      { { 0, 0 }, { 0, -1 }, { -1, 0 }, { 1, 0 } } },
+    { { 0x1, 0x3, 0x1, 0x0 }, 0, -1, 2, 3, { 2, 1, 0, 0 },
+      { { 0, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } } },
+    { { 0x7, 0x2, 0x0, 0x0 }, -1, 0, 3, 2, { 0, 1, 0, 0 },
+      { { 0, 0 }, { 0, 1 }, { 1, 0 }, { -1, 0 } } },
+    { { 0x2, 0x3, 0x2, 0x0 }, -1, -1, 2, 3, { 1, 2, 0, 0 },
+      { { 0, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } } },
+  },
+  /* L */
+  {
+    { { 0x4, 0x7, 0x0, 0x0 }, -1, -1, 3, 2, { 1, 1, 1, 0 },
+      { { 0, 0 }, { 1, -1 }, { -1, 0 }, { 1, 0 } } },
+    { { 0x1, 0x1, 0x3, 0x0 }, 0, -1, 2, 3, { 2, 2, 0, 0 },
+      { { 0, 0 }, { 1, 1 }, { 0, -1 }, { 0, 1 } } },
+    { { 0x7, 0x1, 0x0, 0x0 }, -1, 0, 3, 2, { 1, 0, 0, 0 },
+      { { 0, 0 }, { -1, 1 }, { 1, 0 }, { -1, 0 } } },
+    { { 0x3, 0x2, 0x2, 0x0 }, -1, -1, 2, 3, { 0, 2, 0, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, 1 }, { 0, -1 } } },
+  },
+  /* J */
+  {
+    { { 0x1, 0x7, 0x0, 0x0 }, -1, -1, 3, 2, { 1, 1, 1, 0 },
+      { { 0, 0 }, { -1, -1 }, { -1, 0 }, { 1, 0 } } },
+    { { 0x3, 0x1, 0x1, 0x0 }, 0, -1, 2, 3, { 2, 0, 0, 0 },
+      { { 0, 0 }, { 1, -1 }, { 0, -1 }, { 0, 1 } } },
+    { { 0x7, 0x4, 0x0, 0x0 }, -1, 0, 3, 2, { 0, 0, 1, 0 },
+      { { 0, 0 }, { 1, 1 }, { 1, 0 }, { -1, 0 } } },
+    { { 0x2, 0x2, 0x3, 0x0 }, -1, -1, 2, 3, { 2, 2, 0, 0 },
+      { { 0, 0 }, { -1, 1 }, { 0, 1 }, { 0, -1 } } },
+  },
+  /* O */
+  {
+    { { 0x3, 0x3, 0x0, 0x0 }, -1, -1, 2, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, -1 }, { -1, 0 } } },
+    { { 0x3, 0x3, 0x0, 0x0 }, -1, -1, 2, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, -1 }, { -1, 0 } } },
+    { { 0x3, 0x3, 0x0, 0x0 }, -1, -1, 2, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, -1 }, { -1, 0 } } },
+    { { 0x3, 0x3, 0x0, 0x0 }, -1, -1, 2, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, -1 }, { -1, 0 } } },
+  },
+  /* S */
+  {
+    { { 0x6, 0x3, 0x0, 0x0 }, -1, -1, 3, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { 0, -1 }, { 1, -1 }, { -1, 0 } } },
+    { { 0x1, 0x3, 0x2, 0x0 }, 0, -1, 2, 3, { 1, 2, 0, 0 },
+      { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, -1 } } },
+    { { 0x6, 0x3, 0x0, 0x0 }, -1, 0, 3, 2, { 1, 1, 0, 0 },
+      { { 0, 0 }, { 0, 1 }, { -1, 1 }, { 1, 0 } } },
+    { { 0x1, 0x3, 0x2, 0x0 }, -1, -1, 2, 3, { 1, 2, 0, 0 },
+      { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0, 1 } } },
+  },
+  /* Z */
+  {
+    { { 0x3, 0x6, 0x0, 0x0 }, -1, -1, 3, 2, { 0, 1, 1, 0 },
+      { { 0, 0 }, { -1, -1 }, { 0, -1 }, { 1, 0 } } },
+    { { 0x2, 0x3, 0x1, 0x0 }, 0, -1, 2, 3, { 2, 1, 0, 0 },
+      { { 0, 0 }, { 1, -1 }, { 1, 0 }, { 0, 1 } } },
+    { { 0x3, 0x6, 0x0, 0x0 }, -1, 0, 3, 2, { 0, 1, 1, 0 },
+      { { 0, 0 }, { 1, 1 }, { 0, 1 }, { -1, 0 } } },
+    { { 0x2, 0x3, 0x1, 0x0 }, -1, -1, 2, 3, { 2, 1, 0, 0 },
+      { { 0, 0 }, { -1, 1 }, { -1, 0 }, { 0, -1 } } },
+  },
+};
+
 /* Resets the block to its default positional state */
 static void
 block_reset(block* pblock)
 {
-  int index = 0; /* used in macro def. PIECE_XY() */
-
   pblock->col_off = TETRIS_MAX_COLUMNS / 2;
   pblock->row_off = 1;
+  pblock->rotation = 0;
 
   pblock->soft_drop = 0;
   pblock->hard_drop = 0;
   pblock->hold = false;
-  pblock->t_spin = false;
+  pblock->last_rot = false;
+  pblock->kick = 0;
+  pblock->t_spin = TETRIS_T_SPIN_NONE;
   pblock->lock_delay = false;
 
-#define PIECE_XY(X, Y)                                                         \
-  pblock->p[index].x = X;                                                      \
-  pblock->p[index++].y = Y;
-
-  /* The piece at (0, 0) is the pivot when we rotate. */
-  PIECE_XY(0, 0);
-
-  switch (pblock->type) {
-    case TETRIS_O_BLOCK:
-      PIECE_XY(-1, -1);
-      PIECE_XY(0, -1);
-      PIECE_XY(-1, 0);
-      break;
-    case TETRIS_I_BLOCK:
-      pblock->col_off--; /* center */
-
-      PIECE_XY(-1, 0);
-      PIECE_XY(1, 0);
-      PIECE_XY(2, 0);
-      break;
-    case TETRIS_T_BLOCK:
-      PIECE_XY(0, -1);
-      PIECE_XY(-1, 0);
-      PIECE_XY(1, 0);
-      break;
-    case TETRIS_L_BLOCK:
-      PIECE_XY(1, -1);
-      PIECE_XY(-1, 0);
-      PIECE_XY(1, 0);
-      break;
-    case TETRIS_J_BLOCK:
-      PIECE_XY(-1, -1);
-      PIECE_XY(-1, 0);
-      PIECE_XY(1, 0);
-      break;
-    case TETRIS_Z_BLOCK:
-      PIECE_XY(-1, -1);
-      PIECE_XY(0, -1);
-      PIECE_XY(1, 0);
-      break;
-    case TETRIS_S_BLOCK:
-      PIECE_XY(0, -1);
-      PIECE_XY(1, -1);
-      PIECE_XY(-1, 0);
-      break;
-  }
-#undef PIECE_XY
+  /* center */
+  if (pblock->type == TETRIS_I_BLOCK)
+    pblock->col_off--;
 }
 
-/* Randomizes block and sets the initial positions of the pieces */
-static void
-block_randomize(tetris* pgame, block* pblock)
+/* Pull a random block type from the bag */
+static uint8_t
+block_random_type(tetris* pgame)
 {
   /* Create a new bag if necessary, then pull the next piece from it */
   if (bag_is_empty(pgame))
     bag_random_generator(pgame);
 
-  pblock->type = bag_next_piece(pgame);
+  return bag_next_piece(pgame);
+}
 
-  block_reset(pblock);
+/* Add a random block type to the end of the "next" blocks. The ring is
+ * always full, so the end is the slot of the block just taken from the
+ * head. */
+static void
+next_blocks_push(tetris* pgame)
+{
+  pgame->next_blocks[pgame->next_head] = block_random_type(pgame);
+}
+
+/* Shape rows are shifted into a word with room for the bits past the right
+ * wall, when there is one. Otherwise the right wall is checked from the
+ * shape's width.
+ */
+#if TETRIS_MAX_COLUMNS <= 28
+typedef uint32_t shape_row;
+#elif TETRIS_MAX_COLUMNS <= 60
+typedef uint64_t shape_row;
+#else
+typedef uint64_t shape_row;
+#define WALL_BY_WIDTH
+#endif
+
+/* Bits above the last column, the right wall of the board */
+#ifndef WALL_BY_WIDTH
+#define WALL_MASK (~(shape_row)FULL_ROW)
+#else
+#define WALL_MASK 0
+#endif
+
+/*
+ * Check if a block with the given shape collides with the board or walls when
+ * its pivot is at (col, row).
+ *
+ * Each row of the shape is shifted into place and tested against a row of the
+ * board with the right wall set. Rows below the board are always full, so the
+ * floor needs no test once the top of the shape is on the board. A kick can
+ * push a block down past that, so the top row is checked along with the left
+ * wall.
+ */
+static inline __attribute__((always_inline)) int
+block_collides(const tetris* pgame, const struct tetris_shape* shape, int col,
+               int row)
+{
+  int x = col + shape->x;
+  int y = row + shape->y;
+
+#ifndef WALL_BY_WIDTH
+  if (x < 0 || (unsigned)y >= TETRIS_MAX_ROWS)
+    return 1;
+#else
+  if ((unsigned)y >= TETRIS_MAX_ROWS ||
+      (unsigned)x > (unsigned)(TETRIS_MAX_COLUMNS - shape->width))
+    return 1;
+#endif
+
+  const tetris_row* spaces = &pgame->spaces[y];
+
+  return ((((shape_row)shape->rows[0] << x) & (spaces[0] | WALL_MASK)) |
+          (((shape_row)shape->rows[1] << x) & (spaces[1] | WALL_MASK)) |
+          (((shape_row)shape->rows[2] << x) & (spaces[2] | WALL_MASK)) |
+          (((shape_row)shape->rows[3] << x) & (spaces[3] | WALL_MASK))) != 0;
 }
 
 /* translate pieces in block horizontally. */
@@ -204,19 +425,13 @@ block_translate(tetris* pgame, block* pblock, int cmd)
   /* 1 is right, -1 is left */
   int dir = (cmd == TETRIS_MOVE_LEFT) ? -1 : 1;
 
-  /* Check each piece for a collision */
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
-    int bounds_x, bounds_y;
-    bounds_x = pblock->p[i].x + pblock->col_off + dir;
-    bounds_y = pblock->p[i].y + pblock->row_off;
-
-    /* Check out of bounds before we write it */
-    if (bounds_x < 0 || bounds_x >= TETRIS_MAX_COLUMNS || bounds_y < 0 ||
-        bounds_y >= TETRIS_MAX_ROWS || tetris_at_yx(pgame, bounds_y, bounds_x))
-      return 0;
-  }
+  if (block_collides(pgame, tetris_block_shape(pblock), pblock->col_off + dir,
+                     pblock->row_off))
+    return 0;
 
   pblock->col_off += dir;
+  pblock->last_rot = false;
+  pgame->ghost_dirty = true;
 
   return 1;
 }
@@ -229,69 +444,93 @@ block_rotate(tetris* pgame, block* pblock, int cmd)
   if (pblock->type == TETRIS_O_BLOCK)
     return 1;
 
-  /* 1 is right, -1 is left */
-  int dir = (cmd == TETRIS_ROT_LEFT) ? -1 : 1;
-
-  int new_x[4], new_y[4];
-
-  /* Check each piece for a collision before we write any changes */
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
-    new_x[i] = pblock->p[i].y * (-dir);
-    new_y[i] = pblock->p[i].x * (dir);
-
-    int bounds_x, bounds_y;
-    bounds_x = new_x[i] + pblock->col_off;
-    bounds_y = new_y[i] + pblock->row_off;
+  /* Next rotation to the right, or previous rotation to the left */
+  uint8_t rotation = (pblock->rotation + (cmd == TETRIS_ROT_LEFT ? 3 : 1)) & 3;
 
-    /* Check for out of bounds on each piece */
-    if (bounds_x < 0 || bounds_x >= TETRIS_MAX_COLUMNS || bounds_y < 0 ||
-        bounds_y >= TETRIS_MAX_ROWS ||
-        /* Check for collision with another piece */
-        tetris_at_yx(pgame, bounds_y, bounds_x))
-      return 0;
-  }
+  if (block_collides(pgame, &tetris_shapes[pblock->type][rotation],
+                     pblock->col_off, pblock->row_off))
+    return 0;
 
   /* No collisions, so update the block position. */
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
-    pblock->p[i].x = new_x[i];
-    pblock->p[i].y = new_y[i];
-  }
+  pblock->rotation = rotation;
+  pblock->last_rot = true;
+  pblock->kick = 0;
+  pgame->ghost_dirty = true;
 
   return 1;
 }
 
 /*
- * Tetris Guidlines:
- * If rotation fails, try to move the block left, then try to rotate again.
- * If translation or rotation fails again, try to translate right, then try to
- * 	rotate again.
+ * Tetris Guidlines, Super Rotation System wall kicks:
+ * Offsets to try in order when rotating to the right or to the left from each
+ * rotation, the first one that fits is used. The J, L, S, T and Z blocks share
+ * a table, the I block has its own. Rows count down the board, so y is the
+ * opposite of the usual SRS tables.
+ */
+static const struct kick
+{
+  int8_t x, y;
+} srs_kicks[2][4][2][TETRIS_NUM_KICKS] = {
+  /* J, L, S, T, Z */
+  {
+    { { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0, 2 }, { -1, 2 } },
+      { { 0, 0 }, { 1, 0 }, { 1, -1 }, { 0, 2 }, { 1, 2 } } },
+    { { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, -2 }, { 1, -2 } },
+      { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, -2 }, { 1, -2 } } },
+    { { { 0, 0 }, { 1, 0 }, { 1, -1 }, { 0, 2 }, { 1, 2 } },
+      { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0, 2 }, { -1, 2 } } },
+    { { { 0, 0 }, { -1, 0 }, { -1, 1 }, { 0, -2 }, { -1, -2 } },
+      { { 0, 0 }, { -1, 0 }, { -1, 1 }, { 0, -2 }, { -1, -2 } } },
+  },
+  /* I */
+  {
+    { { { 0, 0 }, { -2, 0 }, { 1, 0 }, { -2, 1 }, { 1, -2 } },
+      { { 0, 0 }, { -1, 0 }, { 2, 0 }, { -1, -2 }, { 2, 1 } } },
+    { { { 0, 0 }, { -1, 0 }, { 2, 0 }, { -1, -2 }, { 2, 1 } },
+      { { 0, 0 }, { 2, 0 }, { -1, 0 }, { 2, -1 }, { -1, 2 } } },
+    { { { 0, 0 }, { 2, 0 }, { -1, 0 }, { 2, -1 }, { -1, 2 } },
+      { { 0, 0 }, { 1, 0 }, { -2, 0 }, { 1, 2 }, { -2, -1 } } },
+    { { { 0, 0 }, { 1, 0 }, { -2, 0 }, { 1, 2 }, { -2, -1 } },
+      { { 0, 0 }, { -2, 0 }, { 1, 0 }, { -2, 1 }, { 1, -2 } } },
+  },
+};
+
+/*
+ * Rotate the block, moving it by the first kick offset that fits. Each offset
+ * is one collision test, the block is only moved once one fits. Returns the
+ * index of the kick used, or -1 if none fit.
  */
 static int
 block_wall_kick(tetris* pgame, block* pblock, int cmd)
 {
-  /* Try to rotate block the normal way. */
-  if (block_rotate(pgame, pblock, cmd) == 1)
-    return 1;
+  /* Don't rotate O block */
+  if (pblock->type == TETRIS_O_BLOCK)
+    return 0;
 
-  /* Try to move left and rotate again. */
-  if (block_translate(pgame, pblock, TETRIS_MOVE_LEFT) == 1) {
-    if (block_rotate(pgame, pblock, cmd) == 1)
-      return 1;
-    else
-      /* undo previous translation */
-      block_translate(pgame, pblock, TETRIS_MOVE_RIGHT);
-  }
+  int dir = (cmd == TETRIS_ROT_LEFT);
+  uint8_t rotation = (pblock->rotation + (dir ? 3 : 1)) & 3;
+  const struct tetris_shape* shape = &tetris_shapes[pblock->type][rotation];
+  const struct kick* kicks =
+    srs_kicks[pblock->type == TETRIS_I_BLOCK][pblock->rotation][dir];
+
+  for (int i = 0; i < TETRIS_NUM_KICKS; i++) {
+    int col = pblock->col_off + kicks[i].x;
+    int row = pblock->row_off + kicks[i].y;
 
-  /* Try to move right and rotate again. */
-  if (block_translate(pgame, pblock, TETRIS_MOVE_RIGHT) == 1) {
-    if (block_rotate(pgame, pblock, cmd) == 1)
-      return 1;
-    else
-      /* undo previous translation */
-      block_translate(pgame, pblock, TETRIS_MOVE_LEFT);
+    if (block_collides(pgame, shape, col, row))
+      continue;
+
+    pblock->col_off = col;
+    pblock->row_off = row;
+    pblock->rotation = rotation;
+    pblock->last_rot = true;
+    pblock->kick = i;
+    pgame->ghost_dirty = true;
+
+    return i;
   }
 
-  return 0;
+  return -1;
 }
 
 /*
@@ -302,21 +541,97 @@ block_wall_kick(tetris* pgame, block* pblock, int cmd)
 static int
 block_fall(tetris* pgame, block* pblock, int dir)
 {
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
-    int bounds_x, bounds_y;
-    bounds_y = pblock->p[i].y + pblock->row_off + dir;
-    bounds_x = pblock->p[i].x + pblock->col_off;
-
-    if (bounds_y < 0 || bounds_y >= TETRIS_MAX_ROWS ||
-        tetris_at_yx(pgame, bounds_y, bounds_x))
-      return 0;
-  }
+  if (block_collides(pgame, tetris_block_shape(pblock), pblock->col_off,
+                     pblock->row_off + dir))
+    return 0;
 
   pblock->row_off += dir;
+  pblock->last_rot = false;
+  pgame->ghost_dirty = true;
 
   return 1;
 }
 
+/* Three spaces of row y centered on column x, from left to right in bits 0
+ * to 2. The walls and floor count as filled, the rows above the board don't.
+ */
+static inline unsigned
+row_window(const tetris* pgame, int y, int x)
+{
+  if (y < 0)
+    return (x == 0 ? 1 : 0) | (x == TETRIS_MAX_COLUMNS - 1 ? 4 : 0);
+
+  tetris_row row = pgame->spaces[y];
+  unsigned window = x > 0 ? (row >> (x - 1)) & 7 : ((row << 1) & 6) | 1;
+
+  if (x == TETRIS_MAX_COLUMNS - 1)
+    window |= 4;
+
+  return window;
+}
+
+/*
+ * Tetris Guidlines, the three-corner T-spin:
+ * The last move of a T block was a rotation, and three of the four corners
+ * diagonal to its center are filled. It's a mini T-spin unless both corners
+ * on the side the T points to are filled.
+ */
+static uint8_t
+block_t_spin(const tetris* pgame, const block* pblock)
+{
+  /* Corners as bits: top left, top right, bottom left, bottom right */
+  static const uint8_t front[4] = { 0x3, 0xa, 0xc, 0x5 };
+
+  if (pblock->type != TETRIS_T_BLOCK || !pblock->last_rot)
+    return TETRIS_T_SPIN_NONE;
+
+  unsigned above = row_window(pgame, pblock->row_off - 1, pblock->col_off);
+  unsigned below = row_window(pgame, pblock->row_off + 1, pblock->col_off);
+
+  /* The corners are bits 0 and 2 of each window */
+  unsigned corners = (above & 1) | (above & 4) >> 1 | (below & 1) << 2 |
+                     (below & 4) << 1;
+
+  if (BIT_COUNT(corners) < 3)
+    return TETRIS_T_SPIN_NONE;
+
+  if ((corners & front[pblock->rotation]) == front[pblock->rotation])
+    return TETRIS_T_SPIN_FULL;
+
+  /* A mini T-spin is full if the block got there by the last kick */
+  if (pblock->kick == TETRIS_NUM_KICKS - 1)
+    return TETRIS_T_SPIN_FULL;
+
+  return TETRIS_T_SPIN_MINI;
+}
+
+/* Bit below the last row of a column, the floor of the board */
+#define FLOOR_BIT ((tetris_column)1 << TETRIS_MAX_ROWS)
+
+/*
+ * Number of rows the block can fall before it lands. In each column of the
+ * block, the distance to the first set bit below its lowest piece.
+ */
+static int
+block_drop_distance(const tetris* pgame, const block* pblock)
+{
+  const struct tetris_shape* shape = tetris_block_shape(pblock);
+  int x = pblock->col_off + shape->x;
+  int y = pblock->row_off + shape->y;
+  int dist = TETRIS_MAX_ROWS;
+
+  for (int i = 0; i < shape->width; i++) {
+    tetris_column below =
+      (pgame->columns[x + i] | FLOOR_BIT) >> (y + shape->bottom[i] + 1);
+    int d = BIT_CTZ(below);
+
+    if (d < dist)
+      dist = d;
+  }
+
+  return dist;
+}
+
 /*
  * Decrease the tick delay of the falling block.
  * Algorithm will most likely change. It currently follows the arctan curve.
@@ -331,51 +646,112 @@ update_tick_speed(tetris* pgame)
   pgame->tick_nsec = 1E9 / speed - 1;
 }
 
-/* To prevent an additional free/malloc we recycle the allocated memory.
- *
- * Remove the "Current" block and reinstall it at the end of the list
+/*
+ * The first "next" block becomes the current block, and a new block is added
+ * to the end of the "next" blocks in its place.
  */
 static void
 update_cur_block(tetris* pgame)
 {
-  block *last, *np = CURRENT_BLOCK(pgame);
+  block* np = CURRENT_BLOCK(pgame);
+
+  np->type = pgame->next_blocks[pgame->next_head];
+  block_reset(np);
+  event_push(pgame, TETRIS_EVENT_SPAWN, np->type, 0);
+
+  next_blocks_push(pgame);
+  pgame->next_head = (pgame->next_head + 1) & NEXT_BLOCKS_MASK;
+
+  pgame->ghost_dirty = true;
+}
+
+/* Deal a new sequence: fresh bag, "next" blocks and current block.
+ * The hold box is emptied, it may hold a block from the old sequence.
+ */
+static void
+deal_blocks(tetris* pgame)
+{
+  bag_random_generator(pgame);
 
-  LIST_REMOVE(np, entries);
+  pgame->hold_block = 0;
+  pgame->next_head = 0;
+  for (size_t i = 0; i < TETRIS_NEXT_BLOCKS_MAX; i++)
+    pgame->next_blocks[i] = block_random_type(pgame);
+
+  update_cur_block(pgame);
+  undo_push(pgame);
+}
+
+/* An empty board at level 1, with no blocks dealt */
+static void
+clear_game(tetris* pgame)
+{
+  memset(pgame, 0, sizeof *pgame);
 
-  block_randomize(pgame, np);
+  /* The floor, rows below the board are always full */
+  for (size_t i = TETRIS_MAX_ROWS; i < LEN(pgame->spaces); i++)
+    pgame->spaces[i] = (tetris_row)-1;
 
-  /* Find last block in list */
-  for (last = FIRST_NEXT_BLOCK(pgame); last && last->entries.le_next;
-       last = last->entries.le_next)
-    ;
+  pgame->level = 1;
+  update_tick_speed(pgame);
 
-  LIST_INSERT_AFTER(last, np, entries);
+  pgame->ghost_dirty = true;
 }
 
+/* Only called through tetris_get_ghost_block(), when the current block or
+ * the board changed since the ghost was last placed. */
 static void
 update_ghost_block(tetris* pgame, block* pblock)
 {
   /* Copy type for block color */
   pblock->type = CURRENT_BLOCK(pgame)->type;
-  /* Offsets and piece positions */
+  /* Offsets and rotation */
   pblock->row_off = CURRENT_BLOCK(pgame)->row_off;
   pblock->col_off = CURRENT_BLOCK(pgame)->col_off;
-  memcpy(pblock->p, CURRENT_BLOCK(pgame)->p, sizeof pblock->p);
+  pblock->rotation = CURRENT_BLOCK(pgame)->rotation;
 
   /* Move it to the bottom of the game */
-  while (block_fall(pgame, pblock, 1))
-    ;
+  pblock->row_off += block_drop_distance(pgame, pblock);
+
+  pgame->ghost_dirty = false;
+}
+
+/*
+ * Recompute the height and holes of each column set in cols, from columns[].
+ * Row fill counts are kept by the callers, who know which rows changed.
+ */
+static void
+update_metrics(tetris* pgame, tetris_row cols)
+{
+  for (; cols; cols &= cols - 1) {
+    int x = BIT_CTZ(cols);
+    tetris_column col = pgame->columns[x];
+
+    /* Bit 0 is the top row, the lowest set bit is the top of the stack */
+    uint8_t height = col ? TETRIS_MAX_ROWS - BIT_CTZ(col) : 0;
+    uint8_t holes = height - BIT_COUNT(col);
+
+    pgame->holes += holes - pgame->column_holes[x];
+    pgame->heights[x] = height;
+    pgame->column_holes[x] = holes;
+  }
+
+  pgame->max_height = 0;
+  for (int x = 0; x < TETRIS_MAX_COLUMNS; x++)
+    if (pgame->heights[x] > pgame->max_height)
+      pgame->max_height = pgame->heights[x];
 }
 
 /* Write the current block to the game board.  */
 static void
 write_block(tetris* pgame, block* pblock)
 {
+  const struct tetris_shape* shape = tetris_block_shape(pblock);
   int new_x[4], new_y[4];
 
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
-    new_x[i] = pblock->col_off + pblock->p[i].x;
-    new_y[i] = pblock->row_off + pblock->p[i].y;
+  for (size_t i = 0; i < LEN(shape->p); i++) {
+    new_x[i] = pblock->col_off + shape->p[i].x;
+    new_y[i] = pblock->row_off + shape->p[i].y;
 
     if (new_x[i] < 0 || new_x[i] >= TETRIS_MAX_COLUMNS || new_y[i] < 0 ||
         new_y[i] >= TETRIS_MAX_ROWS)
@@ -383,59 +759,90 @@ write_block(tetris* pgame, block* pblock)
   }
 
   /* Set the bit where the block exists */
-  for (size_t i = 0; i < LEN(pblock->p); i++) {
+  tetris_row changed = 0;
+  for (size_t i = 0; i < LEN(shape->p); i++) {
     tetris_set_yx(pgame, new_y[i], new_x[i]);
+    pgame->columns[new_x[i]] |= (tetris_column)1 << new_y[i];
     pgame->colors[new_y[i]][new_x[i]] = pblock->type;
+    pgame->row_fill[new_y[i]]++;
+    changed |= (tetris_row)1 << new_x[i];
   }
+
+  update_metrics(pgame, changed);
+
+  pgame->pieces++;
+  pgame->ghost_dirty = true;
 }
 
 /*
- * We first check each row for a full line, and shift all rows above this down.
+ * Find every full row in one pass, then move the remaining rows down over
+ * them in a second pass from the bottom up.
  * We currently implement naive gravity.
  */
 static int
 destroy_lines(tetris* pgame)
 {
-  uint8_t i, j;
+  /* Fill in all bits below bit TETRIS_MAX_COLUMNS. Row populations are
+   * stored in a bit field, so we can check for a full row by comparing it to
+   * this value.
+   */
+  const tetris_row full_row = FULL_ROW;
 
-  /* Lines destroyed this turn. <= 4. */
-  uint8_t destroyed = 0;
+  /* One bit for each full row */
+  tetris_column full = 0;
 
   /* The first two rows are 'above' the game, that's where the new blocks
    * come into existence. We lose if there's ever a block there. */
-  if (pgame->spaces[0] || pgame->spaces[1])
+  if (pgame->max_height > TETRIS_MAX_ROWS - 2 && !pgame->lose) {
     pgame->lose = true;
+    event_push(pgame, TETRIS_EVENT_GAME_OVER, 0, TETRIS_LOSE);
+  }
 
-  /* Check each row for a full line,
-   * we check in reverse to ease moving the rows down when we find a full
-   * row. Ignore the top two rows, which we checked above.
-   */
-  for (i = TETRIS_MAX_ROWS - 1; i >= 2; i--) {
+  /* Ignore the top two rows, which we checked above. */
+  for (int i = 2; i < TETRIS_MAX_ROWS; i++)
+    full |= (tetris_column)(pgame->spaces[i] == full_row) << i;
 
-    /* Fill in all bits below bit TETRIS_MAX_COLUMNS. Row
-     * populations are stored in a bit field, so we can check for a
-     * full row by comparing it to this value.
-     */
-    uint32_t full_row = (1 << TETRIS_MAX_COLUMNS) - 1;
+  if (!full)
+    return 0;
+
+  /* Lines destroyed this turn. <= 4. */
+  uint8_t destroyed = BIT_COUNT(full);
 
-    if (pgame->spaces[i] != full_row)
+  /* Move lines above destroyed lines down */
+  int dst = TETRIS_MAX_ROWS - 1;
+  for (int i = TETRIS_MAX_ROWS - 1; i >= 0; i--) {
+    if (full & ((tetris_column)1 << i))
       continue;
 
-    /* Move lines above destroyed line down */
-    for (j = i; j > 0; j--) {
-      pgame->spaces[j] = pgame->spaces[j - 1];
-      memcpy(pgame->colors[j], pgame->colors[j - 1],
-             TETRIS_MAX_COLUMNS * sizeof *pgame->colors[0]);
+    if (dst != i) {
+      pgame->spaces[dst] = pgame->spaces[i];
+      pgame->row_fill[dst] = pgame->row_fill[i];
+      memcpy(pgame->colors[dst], pgame->colors[i], sizeof pgame->colors[0]);
     }
+    dst--;
+  }
 
-    /* Fill top row colors with zeros. */
-    memset(pgame->colors[0], 0, TETRIS_MAX_COLUMNS * sizeof *pgame->colors[0]);
+  /* Fill the top rows with zeros. */
+  for (; dst >= 0; dst--) {
+    pgame->spaces[dst] = 0;
+    pgame->row_fill[dst] = 0;
+    memset(pgame->colors[dst], 0, sizeof pgame->colors[0]);
+  }
+
+  /* Remove the rows from each column, top row first so the rows below
+   * keep their place */
+  for (tetris_column rows = full; rows; rows &= rows - 1) {
+    int i = BIT_CTZ(rows);
+    tetris_column mask = ((tetris_column)1 << i) - 1;
 
-    /* Lines are moved down, so we recheck this row. */
-    i++;
-    destroyed++;
+    for (int j = 0; j < TETRIS_MAX_COLUMNS; j++) {
+      tetris_column above = pgame->columns[j] & mask;
+      pgame->columns[j] = (above << 1) | (pgame->columns[j] & ~(mask << 1 | 1));
+    }
   }
 
+  update_metrics(pgame, FULL_ROW);
+
   pgame->lines_destroyed += destroyed;
   return destroyed;
 }
@@ -448,12 +855,12 @@ update_level(tetris* pgame)
   /* level^2 + level*3 + 2 */
   while (lines >= (pgame->level * pgame->level + 3 * pgame->level + 2)) {
     pgame->level++;
-    logs_to_game("Level up! Speed up!");
+    event_push(pgame, TETRIS_EVENT_LEVEL_UP, 0, pgame->level);
   }
 }
 
-/* Get points based on number of lines destroyed, or if 0, get points based on
- * how far the block fell.
+/* Get points based on number of lines destroyed and T-spins, plus points
+ * for how far the block fell.
  *
  * We do a bit of logic to add points to the game. Line clears which are
  * considered difficult(as per the Tetris Guidlines) will yield more points by
@@ -462,43 +869,40 @@ update_level(tetris* pgame)
 static void
 update_points(tetris* pgame, uint8_t destroyed)
 {
+  /* Point values from the Tetris Guidlines, by T-spin and lines cleared */
+  static const uint16_t points[3][5] = {
+    [TETRIS_T_SPIN_NONE] = { 0, 100, 300, 500, 800 },
+    [TETRIS_T_SPIN_MINI] = { 100, 200, 400, 0, 0 },
+    [TETRIS_T_SPIN_FULL] = { 400, 800, 1200, 1600, 0 },
+  };
+
+  const block* cur = CURRENT_BLOCK(pgame);
   size_t point_mod = 0;
 
-  if (destroyed == 0 || destroyed > 4)
+  if (destroyed > 4)
     goto done;
 
-  /* Number of lines destroyed in move
-   * Point values from the Tetris Guidlines
-   */
-  switch (destroyed) {
-    case 1:
-      point_mod = 100;
-      break;
-    case 2:
-      point_mod = 300;
-      break;
-    case 3:
-      point_mod = 500;
-      break;
-    case 4:
-      point_mod = 800;
-      break;
-  }
+  point_mod = points[cur->t_spin][destroyed];
 
-  /* Add difficulty bonus for consecutive difficult moves */
-  if (pgame->difficult == true)
-    point_mod = (point_mod * 3) / 2;
+  if (cur->t_spin == TETRIS_T_SPIN_FULL)
+    event_push(pgame, TETRIS_EVENT_T_SPIN, cur->type, destroyed);
+  else if (cur->t_spin == TETRIS_T_SPIN_MINI)
+    event_push(pgame, TETRIS_EVENT_T_SPIN_MINI, cur->type, destroyed);
+
+  /* Placing a block without clearing lines doesn't change difficulty */
+  if (destroyed == 0)
+    goto done;
+
+  event_push(pgame, TETRIS_EVENT_LINES, cur->type, destroyed);
 
   /* point modifier, "difficult" line clears earn more over time.
-   * a tetris (4 line clears) counts for 1 difficult move.
+   * a tetris (4 line clears) or a T-spin counts for 1 difficult move.
    *
    * consecutive difficult moves inc. points by 3/2
    */
-  if (destroyed == 4) {
-    logs_to_game("Tetris!");
-    pgame->difficult = true;
-  } else if (CURRENT_BLOCK(pgame)->t_spin) {
-    logs_to_game("T spin!");
+  if (destroyed == 4 || cur->t_spin != TETRIS_T_SPIN_NONE) {
+    if (pgame->difficult == true)
+      point_mod = (point_mod * 3) / 2;
     pgame->difficult = true;
   } else {
     /* We lose our difficulty multipliers on easy moves */
@@ -506,12 +910,32 @@ update_points(tetris* pgame, uint8_t destroyed)
   }
 
 done : {
-  int score_inc = (point_mod * pgame->level) + CURRENT_BLOCK(pgame)->soft_drop +
-                  (CURRENT_BLOCK(pgame)->hard_drop * 2);
+  int score_inc =
+    (point_mod * pgame->level) + cur->soft_drop + (cur->hard_drop * 2);
   pgame->score += score_inc;
 }
 }
 
+/* Lock the current block where it is, remove lines, update points and
+ * level, and bring in the next block */
+static void
+lock_block(tetris* pgame)
+{
+  if (pgame->enable_tspins)
+    CURRENT_BLOCK(pgame)->t_spin = block_t_spin(pgame, CURRENT_BLOCK(pgame));
+
+  write_block(pgame, CURRENT_BLOCK(pgame));
+  event_push(pgame, TETRIS_EVENT_LOCK, CURRENT_BLOCK(pgame)->type, 0);
+
+  int lines = destroy_lines(pgame);
+
+  update_level(pgame);
+  update_tick_speed(pgame);
+  update_points(pgame, lines);
+  update_cur_block(pgame);
+  undo_push(pgame);
+}
+
 /*
  * Controls the game gravity, and (attempts to)remove lines when a block
  * reaches the bottom. Indirectly creates new blocks, and updates points,
@@ -527,47 +951,22 @@ tetris_tick(tetris* pgame)
     return;
   }
 
-  /* Check for T-Spin */
-  /* A T-Spin is counted if a T block cannot move left, right, or
-   * up and a line is cleared.
-   */
-  if (pgame->enable_tspins && CURRENT_BLOCK(pgame)->type == TETRIS_T_BLOCK) {
-
-    CURRENT_BLOCK(pgame)->t_spin = true;
-
-    /* Try to move left, if it succeeds, we move it back
-     * and fail
-     */
-    if (block_translate(pgame, CURRENT_BLOCK(pgame), TETRIS_MOVE_LEFT)) {
-      block_translate(pgame, CURRENT_BLOCK(pgame), TETRIS_MOVE_RIGHT);
-      CURRENT_BLOCK(pgame)->t_spin = false;
-    }
-
-    /* Try to move right, if successful move back and
-     * fail. */
-    if (block_translate(pgame, CURRENT_BLOCK(pgame), TETRIS_MOVE_RIGHT)) {
-      block_translate(pgame, CURRENT_BLOCK(pgame), TETRIS_MOVE_LEFT);
-      CURRENT_BLOCK(pgame)->t_spin = false;
-    }
-
-    /* Try to move up, if successful, move down and fail */
-    if (block_fall(pgame, CURRENT_BLOCK(pgame), -1)) {
-      block_fall(pgame, CURRENT_BLOCK(pgame), 1);
-      CURRENT_BLOCK(pgame)->t_spin = false;
-    }
-  }
-
-  if (!block_fall(pgame, CURRENT_BLOCK(pgame), 1)) {
+  if (!block_fall(pgame, CURRENT_BLOCK(pgame), 1))
+    lock_block(pgame);
+}
 
-    write_block(pgame, CURRENT_BLOCK(pgame));
+/* Nanoseconds from one game tick to the next. With lock delays a hard
+ * dropped block locks once the delay is over, rather than after an
+ * additional tick. */
+static uint64_t
+tick_delay(const tetris* pgame)
+{
+  const block* cur = CURRENT_BLOCK(pgame);
 
-    int lines = destroy_lines(pgame);
+  if (pgame->enable_lock_delay && cur->hard_drop && !cur->lock_delay)
+    return TETRIS_LOCK_DELAY_NSEC;
 
-    update_level(pgame);
-    update_tick_speed(pgame);
-    update_points(pgame, lines);
-    update_cur_block(pgame);
-  }
+  return pgame->tick_nsec;
 }
 
 /* Game Modes */
@@ -585,6 +984,8 @@ static int
 tetris_40_lines(tetris* pgame)
 {
   if (pgame->lines_destroyed >= 40) {
+    if (!pgame->win)
+      event_push(pgame, TETRIS_EVENT_GAME_OVER, 0, TETRIS_WIN);
     pgame->win = true;
     return 1;
   }
@@ -599,82 +1000,565 @@ tetris_timed(tetris* pgame)
   return 0;
 }
 
+/* Game over when this returns 1 */
+static int
+tetris_check_win(tetris* pgame)
+{
+  switch (pgame->gamemode) {
+    case TETRIS_40_LINES:
+      return tetris_40_lines(pgame);
+    case TETRIS_TIMED:
+      return tetris_timed(pgame);
+    case TETRIS_INFINITY:
+    case TETRIS_CLASSIC:
+    default:
+      return tetris_classic(pgame);
+  }
+}
+
 /************************************/
 /*   End Private helper functions   */
 /************************************/
 
 /************************************/
-/*  Begin Public interface to game  */
+/*       Begin Move Generator       */
 /************************************/
 
 /*
- * Setup the game structure for use.  Here we create the initial game pieces
- * for the game (5 'next' pieces, plus the current piece and the 'hold'
- * piece(total 7 game pieces).  We also allocate memory for the board colors,
- * and set some initial variables.
+ * Where a block can get to, for each rotation and row of the top of its
+ * bounding box, as a mask of the columns the left edge of the box can be in.
+ * Working a row of positions at a time, moving left and right is a fill along
+ * the row, falling is a mask of the row below and a rotation is a shift
+ * into another rotation's row for each kick.
  */
-int
-tetris_init(tetris** res)
+struct reach
 {
-  tetris* pgame;
-  if ((pgame = calloc(1, sizeof *pgame)) == NULL) {
-    log_err("Out of memory");
-    return -1;
+  tetris_row seen[4][TETRIS_MAX_ROWS + 1]; // Positions reached
+  tetris_row done[4][TETRIS_MAX_ROWS + 1]; // Positions moved on from
+  tetris_row spun[4][TETRIS_MAX_ROWS + 1]; // Reached by a rotation
+  tetris_row last[4][TETRIS_MAX_ROWS + 1]; // By a rotation's last kick
+  tetris_column dirty[4];                  // Rows with positions to move on
+  tetris_column reached[4];                // Rows with positions in seen
+  tetris_column known[4];                  // Rows of fit worked out
+
+  /* Not cleared, rows are only read once they're known */
+  const tetris* pgame;
+  const struct tetris_shape* shapes;
+  int stack;                              // Top row with anything in it
+  tetris_row fit[4][TETRIS_MAX_ROWS + 1]; // Positions free of the board
+
+  /* Where each kick moves the box, by rotation and direction */
+  struct kick kicks[4][2][TETRIS_NUM_KICKS];
+  int num_kicks;
+};
+
+/* Bit c is set if the shape fits with the left of its box in column c, and
+ * the top in row top. Each piece in a row of the shape rules out the columns
+ * where a space of the board would be under it. */
+static inline __attribute__((always_inline)) tetris_row
+shape_fits(const tetris* pgame, const struct tetris_shape* shape, int top)
+{
+  tetris_row collide = 0;
+
+  for (int i = 0; i < shape->height; i++) {
+    tetris_row row = pgame->spaces[top + i];
+    for (unsigned bits = shape->rows[i]; bits; bits &= bits - 1)
+      collide |= row >> BIT_CTZ(bits);
   }
 
-  srandom(time(NULL));
+  return ~collide & (FULL_ROW >> (shape->width - 1));
+}
 
-  tetris_set_gamemode(pgame, TETRIS_CLASSIC);
-  pgame->level = 1;
-  update_tick_speed(pgame);
+/* The positions of row y of rotation r that are free of the board, only
+ * worked out for the rows the search gets to */
+static inline __attribute__((always_inline)) tetris_row
+reach_fit(struct reach* pr, int r, int y)
+{
+  if (!(pr->known[r] >> y & 1)) {
+    const struct tetris_shape* shape = &pr->shapes[r];
+
+    /* Nothing to hit above the stack */
+    pr->fit[r][y] = y + shape->height <= pr->stack
+                      ? FULL_ROW >> (shape->width - 1)
+                      : shape_fits(pr->pgame, shape, y);
+    pr->known[r] |= (tetris_column)1 << y;
+  }
 
-  /* Add pieces to bag */
-  bag_random_generator(pgame);
-  LIST_INIT(&pgame->blocks_head);
-
-  /* Create and add each block to the linked list */
-  for (size_t i = 0; i < TETRIS_NEXT_BLOCKS_LEN + 2; i++) {
-    block* np = malloc(sizeof *np);
-    if (!np) {
-      log_err("Out of memory");
-      goto mem_err;
-    }
+  return pr->fit[r][y];
+}
 
-    /* randomize() assigns each block a random block (T, Z, etc.)
-     * And it resets the block to its original place(the top of the
-     * game). As the game goes on, we just use this function to get
-     * new blocks. We don't free/malloc new memory for each new
-     * block.
-     */
-    block_randomize(pgame, np);
+/* Spread positions left and right, through the positions in fit. Going
+ * right is an add, the carry runs up through the positions that fit and
+ * clears them. Going left takes doubling steps. */
+static inline __attribute__((always_inline)) tetris_row
+fill_row(tetris_row m, tetris_row fit)
+{
+  tetris_row right = ((tetris_row)(fit + m) ^ fit) & fit;
+  tetris_row left = fit;
 
-    LIST_INSERT_HEAD(&pgame->blocks_head, np, entries);
+  for (int s = 1; s < TETRIS_MAX_COLUMNS; s <<= 1) {
+    m |= left & (m >> s);
+    left &= left >> s;
   }
 
-  pgame->ghost_block = malloc(sizeof *pgame->ghost_block);
-  if (!pgame->ghost_block) {
-    log_err("Out of memory");
-    goto mem_err;
-  }
+  return m | right;
+}
 
-  /* Allocate memory for colors */
-  for (size_t i = 0; i < TETRIS_MAX_ROWS; i++) {
-    pgame->colors[i] = calloc(TETRIS_MAX_COLUMNS, sizeof(*pgame->colors[i]));
-    if (!pgame->colors[i]) {
-      log_err("Out of memory");
-      goto mem_err;
-    }
+/* Add positions to row y of rotation r */
+static inline __attribute__((always_inline)) void
+reach_add(struct reach* pr, int r, int y, tetris_row m)
+{
+  m &= ~pr->seen[r][y];
+  if (m) {
+    pr->seen[r][y] |= m;
+    pr->dirty[r] |= (tetris_column)1 << y;
+    pr->reached[r] |= (tetris_column)1 << y;
   }
+}
 
-  *res = pgame;
-  debug("Game initializing complete");
+/* Rotate the new positions m of row y, each one by the first kick that
+ * fits, as block_wall_kick() does */
+static inline __attribute__((always_inline)) void
+reach_rotate(struct reach* pr, int r, int y, tetris_row m, int dir)
+{
+  int r2 = (r + (dir ? 3 : 1)) & 3;
+  const struct kick* kicks = pr->kicks[r][dir];
 
-  return 1;
+  for (int k = 0; k < pr->num_kicks && m; k++) {
+    int dx = kicks[k].x;
+    int y2 = y + kicks[k].y;
+    if (y2 < 0 || y2 >= TETRIS_MAX_ROWS)
+      continue;
 
-mem_err:
-  *res = NULL;
-  free(pgame);
-  return -1;
+    tetris_row moved = dx >= 0 ? (tetris_row)(m << dx) : m >> -dx;
+    tetris_row fits = moved & reach_fit(pr, r2, y2);
+    if (!fits)
+      continue;
+
+    /* These don't go on to try the next kick */
+    m &= ~(dx >= 0 ? fits >> dx : (tetris_row)(fits << -dx));
+
+    pr->spun[r2][y2] |= fits;
+    if (k == TETRIS_NUM_KICKS - 1)
+      pr->last[r2][y2] |= fits;
+    reach_add(pr, r2, y2, fits);
+  }
+}
+
+/* Rows a block has to be above the stack for the search to start in the open
+ * air, enough to turn there without touching the stack */
+#define OPEN_AIR_ROWS 6
+
+/* Every position the block can reach by moving, rotating and falling */
+static void
+block_reach(const tetris* pgame, const block* pblock, struct reach* pr)
+{
+  int rotations = pblock->type == TETRIS_O_BLOCK ? 1 : 4;
+
+  const struct tetris_shape* shape = tetris_block_shape(pblock);
+  int x = pblock->col_off + shape->x;
+  int y = pblock->row_off + shape->y;
+
+  memset(pr, 0, offsetof(struct reach, pgame));
+  pr->pgame = pgame;
+  pr->shapes = tetris_shapes[pblock->type];
+  pr->stack = TETRIS_MAX_ROWS - pgame->max_height;
+
+  /* Nothing falls through the floor */
+  for (int r = 0; r < rotations; r++) {
+    pr->fit[r][TETRIS_MAX_ROWS] = 0;
+    pr->known[r] = (tetris_column)1 << TETRIS_MAX_ROWS;
+  }
+
+  /* The kicks, moving the box from one rotation's shape to the next */
+  pr->num_kicks = pgame->enable_wallkicks ? TETRIS_NUM_KICKS : 1;
+  for (int r = 0; r < rotations; r++) {
+    for (int dir = 0; dir < 2 && rotations > 1; dir++) {
+      const struct tetris_shape* to = &pr->shapes[(r + (dir ? 3 : 1)) & 3];
+      const struct kick* kicks =
+        srs_kicks[pblock->type == TETRIS_I_BLOCK][r][dir];
+
+      for (int k = 0; k < pr->num_kicks; k++)
+        pr->kicks[r][dir][k] = (struct kick){
+          .x = kicks[k].x + to->x - pr->shapes[r].x,
+          .y = kicks[k].y + to->y - pr->shapes[r].y,
+        };
+    }
+  }
+
+  /*
+   * Far enough above the stack, a block gets to every position of every
+   * rotation. When the block is above that, the search starts from the last
+   * two rows of each rotation that are clear of the stack, rather than
+   * filling every row on the way down. A turn moves the bottom of the box
+   * down 2 rows at most, so from any higher row the first kick fits and
+   * only reaches positions that are in the open too.
+   */
+  int open_air = pr->stack - OPEN_AIR_ROWS;
+  if (open_air >= 3 && y >= 0 && y <= open_air) {
+    for (int r = 0; r < rotations; r++) {
+      int clear = pr->stack - pr->shapes[r].height;
+      reach_add(pr, r, clear - 1, reach_fit(pr, r, clear - 1));
+      reach_add(pr, r, clear, reach_fit(pr, r, clear));
+    }
+  } else {
+    if (x < 0 || y < 0 || y >= TETRIS_MAX_ROWS ||
+        !(reach_fit(pr, pblock->rotation, y) >> x & 1))
+      return;
+
+    reach_add(pr, pblock->rotation, y, (tetris_row)1 << x);
+  }
+
+  bool dirty;
+  do {
+    dirty = false;
+
+    for (int r = 0; r < rotations; r++) {
+      while (pr->dirty[r]) {
+        dirty = true;
+
+        y = BIT_CTZ(pr->dirty[r]);
+        pr->dirty[r] &= pr->dirty[r] - 1;
+
+        tetris_row m = fill_row(pr->seen[r][y], reach_fit(pr, r, y));
+        tetris_row m_new = m & ~pr->done[r][y];
+        pr->seen[r][y] = pr->done[r][y] = m;
+
+        reach_add(pr, r, y + 1, m_new & reach_fit(pr, r, y + 1));
+
+        if (rotations > 1) {
+          reach_rotate(pr, r, y, m_new, 0);
+          reach_rotate(pr, r, y, m_new, 1);
+        }
+      }
+    }
+  } while (dirty);
+}
+
+/* Write the positions where the block locks, those it can't fall from. The
+ * I, S and Z blocks cover the same spaces turned upside down, so those are
+ * only written once. */
+static size_t
+reach_moves(const struct reach* pr, uint8_t type, bool hold,
+            struct tetris_move* moves, size_t len, size_t n)
+{
+  const struct tetris_shape* shapes = tetris_shapes[type];
+  int rotations = type == TETRIS_O_BLOCK ? 1 : 4;
+
+  for (int r = 0; r < rotations; r++) {
+    bool same = r >= 2 && !memcmp(shapes[r].rows, shapes[r - 2].rows,
+                                  sizeof shapes[r].rows);
+    bool twin = r < 2 && rotations == 4 &&
+                !memcmp(shapes[r].rows, shapes[r + 2].rows,
+                        sizeof shapes[r].rows);
+
+    /* The row below is known for every row reached */
+    for (tetris_column rows = pr->reached[r]; rows; rows &= rows - 1) {
+      int y = BIT_CTZ(rows);
+      tetris_row locks = pr->seen[r][y] & ~pr->fit[r][y + 1];
+      if (same && pr->seen[r - 2][y])
+        locks &= ~(pr->seen[r - 2][y] & ~pr->fit[r - 2][y + 1]);
+
+      /* A move written once for both is spun if either is */
+      tetris_row spun = pr->spun[r][y], last = pr->last[r][y];
+      if (twin) {
+        spun |= pr->spun[r + 2][y];
+        last |= pr->last[r + 2][y];
+      }
+
+      for (; locks && len < n; locks &= locks - 1) {
+        int x = BIT_CTZ(locks);
+        moves[len++] = (struct tetris_move){
+          .rotation = r,
+          .column = x - shapes[r].x,
+          .row = y - shapes[r].y,
+          .hold = hold,
+          .spin = spun >> x & 1,
+          .kick = last >> x & 1 ? TETRIS_NUM_KICKS - 1 : 0,
+        };
+      }
+    }
+  }
+
+  return len;
+}
+
+/************************************/
+/*        End Move Generator        */
+/************************************/
+
+/************************************/
+/*     Begin Board Evaluation       */
+/************************************/
+
+/*
+ * Every feature of a board is a count of bits in its rows, from the row and
+ * the rows above it. A space is covered when it's at or under the top of its
+ * column. The height is the covered spaces, holes are the covered spaces that
+ * are empty and bumpiness is a covered space next to one that isn't. Row
+ * transitions are filled spaces next to empty ones, the walls being filled,
+ * and wells are spaces that aren't covered, with filled spaces or walls on
+ * both sides.
+ *
+ * eval_board() works on one board at a time. The vector kernels work on as
+ * many boards as fit in a vector, a row of each board in each lane, so they
+ * go through the rows together.
+ */
+
+/* Columns with a column to their right */
+#define INNER_COLUMNS (FULL_ROW >> 1)
+#define LAST_COLUMN ((tetris_row)1 << (TETRIS_MAX_COLUMNS - 1))
+
+/* Always inlined, so it's compiled for the target of each caller */
+__attribute__((always_inline)) static inline void
+eval_board(const tetris_row* rows, struct tetris_features* pf)
+{
+  tetris_row covered = 0;
+  unsigned height = 0, max_height = 0, holes = 0, bumpiness = 0;
+  unsigned transitions = 0, wells = 0;
+
+  /* Empty rows above the stack only have the walls */
+  int y = 0;
+  while (y < TETRIS_MAX_ROWS && !rows[y])
+    y++;
+  transitions = 2 * y;
+
+  for (; y < TETRIS_MAX_ROWS; y++) {
+    tetris_row row = rows[y];
+    covered |= row;
+
+    height += BIT_COUNT(covered);
+    max_height += covered != 0;
+    holes += BIT_COUNT((tetris_row)(covered & ~row));
+    bumpiness += BIT_COUNT((tetris_row)((covered ^ covered >> 1) &
+                                        INNER_COLUMNS));
+    transitions += BIT_COUNT((tetris_row)((row ^ row >> 1) & INNER_COLUMNS)) +
+                   (~row & 1) + (~row >> (TETRIS_MAX_COLUMNS - 1) & 1);
+    wells += BIT_COUNT((tetris_row)(~covered & (row << 1 | 1) &
+                                    (row >> 1 | LAST_COLUMN) & FULL_ROW));
+  }
+
+  *pf = (struct tetris_features){
+    .height = height,
+    .max_height = max_height,
+    .holes = holes,
+    .bumpiness = bumpiness,
+    .row_transitions = transitions,
+    .wells = wells,
+  };
+}
+
+static void
+eval_scalar(const tetris_row* boards, size_t n, struct tetris_features* pf)
+{
+  for (size_t i = 0; i < n; i++)
+    eval_board(&boards[i * TETRIS_MAX_ROWS], &pf[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The same, with the popcnt instruction for BIT_COUNT() */
+__attribute__((target("popcnt"))) static void
+eval_popcnt(const tetris_row* boards, size_t n, struct tetris_features* pf)
+{
+  for (size_t i = 0; i < n; i++)
+    eval_board(&boards[i * TETRIS_MAX_ROWS], &pf[i]);
+}
+
+/*
+ * A vector kernel NAME, for vectors of BYTES, compiled for TARGET. It
+ * evaluates the boards a whole vector at a time and returns how many it
+ * did, the rest are left for eval_scalar(). Vectors count bits a lane at a
+ * time, adding pairs, then nibbles, then bytes.
+ */
+#define EVAL_KERNEL(NAME, BYTES, TARGET)                                       \
+  typedef tetris_row NAME##_vec __attribute__((vector_size(BYTES)));          \
+                                                                               \
+  __attribute__((target(TARGET))) static inline NAME##_vec NAME##_count(      \
+    NAME##_vec v)                                                              \
+  {                                                                            \
+    v -= v >> 1 & (tetris_row)0x5555555555555555ULL;                           \
+    v = (v & (tetris_row)0x3333333333333333ULL) +                              \
+        (v >> 2 & (tetris_row)0x3333333333333333ULL);                          \
+    v = (v + (v >> 4)) & (tetris_row)0x0f0f0f0f0f0f0f0fULL;                    \
+    for (unsigned s = 8; s < 8 * sizeof(tetris_row); s <<= 1)                 \
+      v += v >> s;                                                             \
+    return v & 0x7f;                                                           \
+  }                                                                            \
+                                                                               \
+  __attribute__((target(TARGET))) static size_t NAME(                          \
+    const tetris_row* boards, size_t n, struct tetris_features* pf)            \
+  {                                                                            \
+    enum { LANES = BYTES / sizeof(tetris_row) };                               \
+    size_t i;                                                                  \
+                                                                               \
+    for (i = 0; i + LANES <= n; i += LANES) {                                  \
+      const tetris_row* b = &boards[i * TETRIS_MAX_ROWS];                      \
+      NAME##_vec covered = { 0 }, height = { 0 }, max_height = { 0 };          \
+      NAME##_vec holes = { 0 }, bumpiness = { 0 }, transitions = { 0 };        \
+      NAME##_vec wells = { 0 };                                                \
+                                                                               \
+      for (int y = 0; y < TETRIS_MAX_ROWS; y++) {                              \
+        NAME##_vec row;                                                        \
+        for (int l = 0; l < LANES; l++)                                        \
+          row[l] = b[l * TETRIS_MAX_ROWS + y];                                 \
+        covered |= row;                                                        \
+                                                                               \
+        height += NAME##_count(covered);                                       \
+        max_height -= (NAME##_vec)(covered != 0);                              \
+        holes += NAME##_count(covered & ~row);                                 \
+        bumpiness += NAME##_count((covered ^ covered >> 1) & INNER_COLUMNS);   \
+        transitions += NAME##_count((row ^ row >> 1) & INNER_COLUMNS) +        \
+                       (~row & 1) + (~row >> (TETRIS_MAX_COLUMNS - 1) & 1);    \
+        wells += NAME##_count(~covered & (row << 1 | 1) &                      \
+                              (row >> 1 | LAST_COLUMN) & FULL_ROW);            \
+      }                                                                        \
+                                                                               \
+      for (int l = 0; l < LANES; l++)                                          \
+        pf[i + l] = (struct tetris_features){                                  \
+          .height = height[l],                                                 \
+          .max_height = max_height[l],                                         \
+          .holes = holes[l],                                                   \
+          .bumpiness = bumpiness[l],                                           \
+          .row_transitions = transitions[l],                                   \
+          .wells = wells[l],                                                   \
+        };                                                                     \
+    }                                                                          \
+                                                                               \
+    return i;                                                                  \
+  }
+
+EVAL_KERNEL(eval_sse2, 16, "sse2")
+EVAL_KERNEL(eval_avx2, 32, "avx2")
+
+#endif
+
+/* No vectors, every board is left for eval_rest() */
+static size_t
+eval_none(const tetris_row* boards, size_t n, struct tetris_features* pf)
+{
+  (void)boards;
+  (void)n;
+  (void)pf;
+
+  return 0;
+}
+
+/* The kernels for this CPU. Chosen once as the library loads and only read
+ * after that, like the hooks. */
+static size_t (*eval_batch)(const tetris_row*, size_t,
+                            struct tetris_features*) = eval_none;
+static void (*eval_rest)(const tetris_row*, size_t,
+                         struct tetris_features*) = eval_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Constructors run before the CPU is checked for anything else, so the
+ * check has to be set up here first */
+__attribute__((constructor)) static void
+eval_init(void)
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    eval_batch = eval_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    eval_batch = eval_sse2;
+
+  if (__builtin_cpu_supports("popcnt"))
+    eval_rest = eval_popcnt;
+}
+
+#endif
+
+/************************************/
+/*      End Board Evaluation        */
+/************************************/
+
+/************************************/
+/*  Begin Public interface to game  */
+/************************************/
+
+void
+tetris_set_hooks(const struct tetris_hooks* phooks)
+{
+  hooks.alloc = (phooks && phooks->alloc) ? phooks->alloc : malloc;
+  hooks.free = (phooks && phooks->free) ? phooks->free : free;
+  hooks.log = phooks ? phooks->log : NULL;
+}
+
+size_t
+tetris_sizeof(void)
+{
+  return sizeof(tetris);
+}
+
+/*
+ * Setup the game structure in buf for use. The whole game is one flat block
+ * of memory, with no pointers of its own, so nothing else is allocated.
+ * Seeding deals the current block and fills the ring buffer of block types
+ * with TETRIS_NEXT_BLOCKS_MAX 'next' blocks, TETRIS_NEXT_BLOCKS_LEN of them
+ * shown. The hold box starts empty.
+ */
+tetris*
+tetris_init_in(void* buf)
+{
+  tetris* pgame = buf;
+
+  clear_game(pgame);
+  tetris_set_gamemode(pgame, TETRIS_CLASSIC);
+
+  pgame->next_len = TETRIS_NEXT_BLOCKS_LEN;
+  tetris_set_seed(pgame, random_init_seed(pgame));
+
+  tetris_log(pgame, TETRIS_LOG_DEBUG, "Game initializing complete");
+
+  return pgame;
+}
+
+int
+tetris_init(tetris** res)
+{
+  void* buf;
+  if ((buf = hooks.alloc(tetris_sizeof())) == NULL) {
+    tetris_log(NULL, TETRIS_LOG_ERR, "Out of memory");
+    return -1;
+  }
+
+  *res = tetris_init_in(buf);
+
+  return 1;
+}
+
+/*
+ * Start over with an empty board. The game mode, attributes, number of
+ * "next" blocks and user data are kept, and the blocks continue on from
+ * the same random sequence.
+ */
+int
+tetris_reset(tetris* pgame)
+{
+  tetris old = *pgame;
+
+  clear_game(pgame);
+
+  pgame->gamemode = old.gamemode;
+  pgame->enable_wallkicks = old.enable_wallkicks;
+  pgame->enable_tspins = old.enable_tspins;
+  pgame->enable_ghosts = old.enable_ghosts;
+  pgame->enable_lock_delay = old.enable_lock_delay;
+  pgame->next_len = old.next_len;
+  pgame->rng_state = old.rng_state;
+  pgame->events = old.events;
+  pgame->undo = old.undo;
+  pgame->user = old.user;
+
+  if (pgame->undo)
+    pgame->undo->len = 0;
+
+  deal_blocks(pgame);
+
+  return 1;
 }
 
 /*
@@ -683,39 +1567,280 @@ mem_err:
 int
 tetris_cleanup(tetris* pgame)
 {
-  block* np;
+  tetris_log(pgame, TETRIS_LOG_DEBUG, "Game Cleanup complete");
 
-  /* Remove each piece in the linked list */
-  while ((np = pgame->blocks_head.lh_first)) {
-    LIST_REMOVE(np, entries);
-    free(np);
-  }
+  hooks.free(pgame);
+
+  return 1;
+}
+
+/*
+ * Events go into the caller's ring buffer. The read and write counters only
+ * ever go up, masked by the size to index the buffer.
+ */
+int
+tetris_events_init(struct tetris_events* pev, struct tetris_event* buf,
+                   uint32_t size)
+{
+  /* A power of 2, so the counters can wrap around */
+  if (size == 0 || (size & (size - 1)))
+    return -1;
+
+  pev->buf = buf;
+  pev->size = size;
+  pev->head = pev->tail = pev->lost = 0;
+
+  return 1;
+}
+
+int
+tetris_events_pop(struct tetris_events* pev, struct tetris_event* ev)
+{
+  if (pev->head == pev->tail)
+    return 0;
+
+  *ev = pev->buf[pev->head++ & (pev->size - 1)];
+
+  return 1;
+}
 
-  for (int i = 0; i < TETRIS_MAX_ROWS; i++)
-    free(pgame->colors[i]);
+/* The ghost block and the caller's pointers are last in the game, a
+ * snapshot is everything before them. */
+void
+tetris_snapshot(const tetris* pgame, void* buf)
+{
+  memcpy(buf, pgame, TETRIS_SNAPSHOT_SIZE);
+}
 
-  free(pgame->ghost_block);
-  free(pgame);
+void
+tetris_restore(tetris* pgame, const void* buf)
+{
+  memcpy(pgame, buf, TETRIS_SNAPSHOT_SIZE);
+  pgame->ghost_dirty = true;
+}
 
-  debug("Game Cleanup complete");
+int
+tetris_undo_init(struct tetris_undo* pu, void* buf, uint32_t size)
+{
+  /* A power of 2, so the counter can wrap around */
+  if (size == 0 || (size & (size - 1)))
+    return -1;
+
+  pu->buf = buf;
+  pu->size = size;
+  pu->top = pu->len = 0;
+
+  return 1;
+}
+
+int
+tetris_set_undo(tetris* pgame, struct tetris_undo* pu)
+{
+  pgame->undo = pu;
+  undo_push(pgame);
 
   return 1;
 }
 
 /*
- * Blocks command processor.
+ * The snapshot on top of the stack is from when the current block spawned,
+ * the one below it from when the last block locked spawned. Drop the first
+ * and go back to the second, which stays on the stack for the block that's
+ * current again.
  */
 int
-tetris_cmd(tetris* pgame, int cmd)
+tetris_undo(tetris* pgame)
 {
-  /* "fail" if these are true so we can escape events_main_loop() */
-  if (pgame->quit || pgame->lose || pgame->win)
+  struct tetris_undo* pu = pgame->undo;
+  if (!pu || pu->len < 2)
     return -1;
 
-  /* While paused, we can only unpause or quit */
-  if (pgame->paused && !(cmd == TETRIS_PAUSE_GAME || cmd == TETRIS_QUIT_GAME))
+  pu->top--;
+  pu->len--;
+
+  size_t slot = (pu->top - 1) & (pu->size - 1);
+  tetris_restore(pgame, pu->buf + slot * TETRIS_SNAPSHOT_SIZE);
+
+  return 1;
+}
+
+/*
+ * Games are allocated n at a time, in one block. A stack of pointers to the
+ * unused games makes taking and returning a game O(1).
+ */
+int
+tetris_pool_init(tetris_pool* pool, size_t n)
+{
+  pool->games = hooks.alloc(n * sizeof *pool->games);
+  pool->free = hooks.alloc(n * sizeof *pool->free);
+  pool->in_use = hooks.alloc(n * sizeof *pool->in_use);
+  if (!pool->games || !pool->free || !pool->in_use) {
+    tetris_log(NULL, TETRIS_LOG_ERR, "Out of memory");
+    tetris_pool_cleanup(pool);
+    return -1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    pool->free[i] = &pool->games[n - 1 - i];
+    pool->in_use[i] = false;
+  }
+
+  pool->len = pool->cap = n;
+
+  return 1;
+}
+
+tetris*
+tetris_pool_get(tetris_pool* pool)
+{
+  if (pool->len == 0)
+    return NULL;
+
+  tetris* pgame = pool->free[--pool->len];
+  pool->in_use[pgame - pool->games] = true;
+
+  return tetris_init_in(pgame);
+}
+
+int
+tetris_pool_put(tetris_pool* pool, tetris* pgame)
+{
+  /* Compared as addresses, a game from elsewhere isn't in the array */
+  uintptr_t start = (uintptr_t)pool->games, at = (uintptr_t)pgame;
+  size_t i = (at - start) / sizeof *pool->games;
+
+  if (at < start || i >= pool->cap ||
+      (at - start) % sizeof *pool->games || !pool->in_use[i]) {
+    tetris_log(NULL, TETRIS_LOG_ERR,
+               "Game put back in a pool it isn't from, or twice");
+    assert(!"tetris_pool_put() of a game not in use from this pool");
+    return -1;
+  }
+
+  pool->in_use[i] = false;
+  pool->free[pool->len++] = pgame;
+
+  return 1;
+}
+
+void
+tetris_pool_cleanup(tetris_pool* pool)
+{
+  hooks.free(pool->games);
+  hooks.free(pool->free);
+  hooks.free(pool->in_use);
+  pool->games = NULL;
+  pool->free = NULL;
+  pool->in_use = NULL;
+  pool->len = pool->cap = 0;
+}
+
+/* Swap the current block with the one in the hold box */
+static void
+hold_block(tetris* pgame)
+{
+  block* cur = CURRENT_BLOCK(pgame);
+
+  /* We can hold each block exactly once */
+  if (cur->hold == true) {
+    event_push(pgame, TETRIS_EVENT_HOLD, cur->type, 0);
+    return;
+  }
+
+  event_push(pgame, TETRIS_EVENT_HOLD, cur->type, 1);
+
+  /* Swap the hold and current block, the first time we hold a block
+   * the current block is replaced by the next block.
+   */
+  if (pgame->hold_block) {
+    uint8_t type = pgame->hold_block;
+    pgame->hold_block = cur->type;
+    cur->type = type;
+    block_reset(cur);
+    event_push(pgame, TETRIS_EVENT_SPAWN, cur->type, 0);
+  } else {
+    pgame->hold_block = cur->type;
+    update_cur_block(pgame);
+  }
+
+  cur->hold = true;
+  pgame->ghost_dirty = true;
+}
+
+/* The block that would come out of the hold box, where it would spawn.
+ * Returns 0 if the current block has already been held. */
+static int
+hold_preview(const tetris* pgame, block* pblock)
+{
+  if (CURRENT_BLOCK(pgame)->hold)
     return 0;
 
+  *pblock = *CURRENT_BLOCK(pgame);
+  pblock->type = pgame->hold_block ? pgame->hold_block
+                                   : pgame->next_blocks[pgame->next_head];
+  block_reset(pblock);
+  pblock->hold = true;
+
+  return 1;
+}
+
+/*
+ * Move a copy of a block as a player would: turn it where it is, move it
+ * across to column and hard drop it. Returns 0 if any step is blocked.
+ */
+static int
+block_place(const tetris* pgame, block* pblock, uint8_t rotation, int column)
+{
+  /* Turn to the right, or once to the left for the previous rotation */
+  int turns = (rotation - pblock->rotation) & 3;
+  int step = 1;
+
+  if (turns == 3) {
+    turns = 1;
+    step = 3;
+  }
+
+  /* Don't rotate O block */
+  if (pblock->type == TETRIS_O_BLOCK)
+    turns = 0;
+
+  while (turns-- > 0) {
+    uint8_t next = (pblock->rotation + step) & 3;
+    if (block_collides(pgame, &tetris_shapes[pblock->type][next],
+                       pblock->col_off, pblock->row_off))
+      return 0;
+
+    pblock->rotation = next;
+    pblock->last_rot = true;
+    pblock->kick = 0;
+  }
+
+  int dir = column < pblock->col_off ? -1 : 1;
+  while (pblock->col_off != column) {
+    if (block_collides(pgame, tetris_block_shape(pblock),
+                       pblock->col_off + dir, pblock->row_off))
+      return 0;
+
+    pblock->col_off += dir;
+    pblock->last_rot = false;
+  }
+
+  int dist = block_drop_distance(pgame, pblock);
+  pblock->row_off += dist;
+  pblock->hard_drop += dist;
+  if (dist)
+    pblock->last_rot = false;
+
+  return 1;
+}
+
+/*
+ * Blocks command processor, the caller checks the game is running and
+ * whether it has been won.
+ */
+static void
+game_cmd(tetris* pgame, int cmd)
+{
   block* cur = CURRENT_BLOCK(pgame);
 
   /* Block lock delays are enabled after a block is hard dropped to the
@@ -745,11 +1870,19 @@ tetris_cmd(tetris* pgame, int cmd)
         cur->soft_drop++;
       break;
 
-    case TETRIS_MOVE_DROP:
+    case TETRIS_MOVE_DROP: {
       /* drop the block to the bottom of the game */
-      while (block_fall(pgame, cur, 1))
-        cur->hard_drop++;
-      break;
+      int dist = block_drop_distance(pgame, cur);
+      cur->row_off += dist;
+      cur->hard_drop += dist;
+      if (dist)
+        cur->last_rot = false;
+      pgame->ghost_dirty = true;
+
+      /* The lock delay starts as the block lands */
+      if (pgame->enable_lock_delay)
+        pgame->tick_elapsed = 0;
+    } break;
   }
 
   if (additional_tick && (cmd == TETRIS_MOVE_LEFT || cmd == TETRIS_MOVE_RIGHT ||
@@ -765,20 +1898,7 @@ tetris_cmd(tetris* pgame, int cmd)
 
   switch (cmd) {
     case TETRIS_HOLD_BLOCK:
-      /* We can hold each block exactly once */
-      if (cur->hold == true) {
-        logs_to_game("Block has already been held.");
-        break;
-      }
-
-      block_reset(cur);
-      cur->hold = true;
-
-      /* Remove the current block and reinstall it at the beginning
-       * of the list. This swaps the hold and current block.
-       */
-      LIST_REMOVE(cur, entries);
-      LIST_INSERT_HEAD(&pgame->blocks_head, cur, entries);
+      hold_block(pgame);
       break;
 
     case TETRIS_QUIT_GAME:
@@ -794,31 +1914,281 @@ tetris_cmd(tetris* pgame, int cmd)
       tetris_tick(pgame);
       break;
   }
+}
 
-  if (pgame->check_win)
-    pgame->check_win(pgame);
+int
+tetris_cmd(tetris* pgame, int cmd)
+{
+  /* "fail" if these are true so we can escape events_main_loop() */
+  if (pgame->quit || pgame->lose || pgame->win)
+    return -1;
+
+  /* While paused, we can only unpause or quit */
+  if (pgame->paused && !(cmd == TETRIS_PAUSE_GAME || cmd == TETRIS_QUIT_GAME))
+    return 0;
 
-  if (pgame->enable_ghosts)
-    update_ghost_block(pgame, pgame->ghost_block);
+  game_cmd(pgame, cmd);
+  tetris_check_win(pgame);
 
   return 1;
 }
 
+/*
+ * Only locking a block can win the game, so the game mode is checked once
+ * when we stop rather than after every command.
+ */
+size_t
+tetris_cmd_batch(tetris* pgame, const uint8_t* cmds, size_t n)
+{
+  uint32_t pieces = pgame->pieces;
+  size_t i = 0;
+
+  while (i < n && !(pgame->quit || pgame->lose || pgame->win)) {
+    int cmd = cmds[i++];
+
+    /* While paused, we can only unpause or quit */
+    if (pgame->paused && !(cmd == TETRIS_PAUSE_GAME || cmd == TETRIS_QUIT_GAME))
+      continue;
+
+    game_cmd(pgame, cmd);
+
+    if (pgame->pieces != pieces)
+      break;
+  }
+
+  tetris_check_win(pgame);
+
+  return i;
+}
+
+/*
+ * Run each game tick that falls within nsec, carrying the time left over to
+ * the next call. The delay is read again after every tick, the level and
+ * the current block can change it.
+ */
 int
-tetris_set_name(tetris* pgame, const char* name)
+tetris_advance(tetris* pgame, uint64_t nsec)
 {
-  strncpy(pgame->id, name, sizeof pgame->id);
-  if (sizeof pgame->id > 0)
-    pgame->id[sizeof pgame->id - 1] = '\0';
+  if (pgame->quit || pgame->lose || pgame->win)
+    return -1;
+
+  if (pgame->paused)
+    return 0;
+
+  pgame->clock_nsec += nsec;
+  nsec += pgame->tick_elapsed;
+
+  int ticks = 0;
+  for (uint64_t delay = tick_delay(pgame); nsec >= delay;
+       delay = tick_delay(pgame)) {
+    nsec -= delay;
+
+    /* The lock delay is over, lock the block on this tick */
+    if (pgame->enable_lock_delay && CURRENT_BLOCK(pgame)->hard_drop)
+      CURRENT_BLOCK(pgame)->lock_delay = true;
+
+    uint32_t pieces = pgame->pieces;
+    tetris_tick(pgame);
+    ticks++;
+
+    if (pgame->lose || (pgame->pieces != pieces && tetris_check_win(pgame)))
+      break;
+  }
+
+  pgame->tick_elapsed = nsec;
+
+  return ticks;
+}
+
+uint64_t
+tetris_next_tick(const tetris* pgame)
+{
+  uint64_t delay = tick_delay(pgame);
+
+  return delay > pgame->tick_elapsed ? delay - pgame->tick_elapsed : 0;
+}
+
+/*
+ * The block is placed on a copy first, so nothing changes when it can't get
+ * there. With use_hold the block that would come out of the hold box is
+ * placed, from where it would spawn.
+ */
+int
+tetris_place(tetris* pgame, uint8_t rotation, int column, bool use_hold)
+{
+  if (pgame->quit || pgame->lose || pgame->win || pgame->paused)
+    return -1;
+
+  if (rotation > 3)
+    return -1;
+
+  block place = *CURRENT_BLOCK(pgame);
+  if (use_hold && !hold_preview(pgame, &place))
+    return -1;
+
+  /* The block has to fit where it starts out */
+  if (block_collides(pgame, tetris_block_shape(&place), place.col_off,
+                     place.row_off))
+    return -1;
+
+  if (!block_place(pgame, &place, rotation, column))
+    return -1;
+
+  if (use_hold)
+    hold_block(pgame);
+
+  *CURRENT_BLOCK(pgame) = place;
+  pgame->ghost_dirty = true;
+
+  lock_block(pgame);
+  tetris_check_win(pgame);
+
+  return 1;
+}
+
+size_t
+tetris_moves(const tetris* pgame, struct tetris_move* moves, size_t n,
+             bool use_hold)
+{
+  /* Nothing can be placed, see tetris_place_move() */
+  if (pgame->quit || pgame->lose || pgame->win || pgame->paused)
+    return 0;
+
+  struct reach reach;
+  const block* cur = CURRENT_BLOCK(pgame);
+
+  block_reach(pgame, cur, &reach);
+  size_t len = reach_moves(&reach, cur->type, false, moves, 0, n);
+
+  /* The same block out of the hold box has the same moves */
+  block held;
+  if (use_hold && hold_preview(pgame, &held) && held.type != cur->type) {
+    block_reach(pgame, &held, &reach);
+    len = reach_moves(&reach, held.type, true, moves, len, n);
+  }
+
+  return len;
+}
+
+int
+tetris_place_move(tetris* pgame, const struct tetris_move* move)
+{
+  if (pgame->quit || pgame->lose || pgame->win || pgame->paused)
+    return -1;
+
+  block place = *CURRENT_BLOCK(pgame);
+  if (move->hold && !hold_preview(pgame, &place))
+    return -1;
+
+  if (move->rotation > 3 || move->kick >= TETRIS_NUM_KICKS ||
+      (place.type == TETRIS_O_BLOCK && move->rotation != 0))
+    return -1;
+
+  const struct tetris_shape* shape = &tetris_shapes[place.type][move->rotation];
+
+  /* The box has to be on the board before anything is tested */
+  int x = move->column + shape->x;
+  int y = move->row + shape->y;
+  if (x < 0 || x > TETRIS_MAX_COLUMNS - shape->width || y < 0 ||
+      y >= TETRIS_MAX_ROWS)
+    return -1;
+
+  /* It has to fit, and be resting on something */
+  if (block_collides(pgame, shape, move->column, move->row) ||
+      !block_collides(pgame, shape, move->column, move->row + 1))
+    return -1;
+
+  place.rotation = move->rotation;
+  place.col_off = move->column;
+  place.row_off = move->row;
+  place.last_rot = move->spin;
+  place.kick = move->spin ? move->kick : 0;
+
+  if (move->hold)
+    hold_block(pgame);
+
+  *CURRENT_BLOCK(pgame) = place;
+  pgame->ghost_dirty = true;
+
+  lock_block(pgame);
+  tetris_check_win(pgame);
+
+  return 1;
+}
+
+void
+tetris_eval(const tetris_row* boards, size_t n, struct tetris_features* pf)
+{
+  /* Whole vectors of boards first, then one at a time */
+  size_t done = eval_batch(boards, n, pf);
+
+  eval_rest(boards + done * TETRIS_MAX_ROWS, n - done, pf + done);
+}
+
+const block*
+tetris_get_ghost_block(tetris* pgame)
+{
+  if (!pgame->enable_ghosts)
+    return NULL;
+
+  if (pgame->ghost_dirty)
+    update_ghost_block(pgame, &pgame->ghost_block);
+
+  return &pgame->ghost_block;
+}
+
+int
+tetris_set_rows(tetris* pgame, size_t row, const tetris_row* rows, size_t n)
+{
+  if (row > TETRIS_MAX_ROWS || n > TETRIS_MAX_ROWS - row)
+    return -1;
+
+  /* Bits past the last column would be walls the blocks can't see */
+  for (size_t i = 0; i < n; i++)
+    if (rows[i] & ~FULL_ROW)
+      return -1;
+
+  memcpy(&pgame->spaces[row], rows, n * sizeof *rows);
+
+  /* Rebuild the columns and metrics from the rows */
+  for (size_t x = 0; x < TETRIS_MAX_COLUMNS; x++) {
+    pgame->columns[x] = 0;
+    for (size_t y = 0; y < TETRIS_MAX_ROWS; y++)
+      if (tetris_at_yx(pgame, y, x))
+        pgame->columns[x] |= (tetris_column)1 << y;
+  }
+
+  for (size_t y = 0; y < TETRIS_MAX_ROWS; y++)
+    pgame->row_fill[y] = BIT_COUNT(pgame->spaces[y]);
+
+  update_metrics(pgame, FULL_ROW);
+
+  pgame->ghost_dirty = true;
+
+  return 1;
+}
+
+int
+tetris_set_next_len(tetris* pgame, size_t len)
+{
+  if (len < 1 || len > TETRIS_NEXT_BLOCKS_MAX)
+    return -1;
+
+  /* Only how many are shown, the ring stays full so the blocks dealt don't
+   * depend on it */
+  pgame->next_len = len;
+
   return 1;
 }
 
 int
-tetris_set_dbfile(tetris* pgame, const char* dbfile)
+tetris_set_seed(tetris* pgame, uint64_t seed)
 {
-  strncpy(pgame->db_file, dbfile, sizeof pgame->db_file);
-  if (sizeof pgame->db_file > 0)
-    pgame->db_file[sizeof pgame->db_file - 1] = '\0';
+  random_seed(pgame, seed);
+  deal_blocks(pgame);
+
+  pgame->ghost_dirty = true;
+
   return 1;
 }
 
@@ -831,23 +2201,14 @@ tetris_set_gamemode(tetris* pgame, enum TETRIS_GAMES gm)
       tetris_set_wallkicks(pgame, 1);
       tetris_set_tspins(pgame, 1);
       tetris_set_lockdelay(pgame, 1);
-
-      strncpy(pgame->gamemode, "40 Lines", sizeof pgame->gamemode);
-      pgame->check_win = tetris_40_lines;
       break;
     case TETRIS_TIMED:
-      /* XXX, change my name when we define tetris_timed() */
-      strncpy(pgame->gamemode, "Classic", sizeof pgame->gamemode);
-      pgame->check_win = tetris_timed;
       break;
     case TETRIS_INFINITY:
       tetris_set_ghosts(pgame, 1);
       tetris_set_wallkicks(pgame, 1);
       tetris_set_tspins(pgame, 1);
       tetris_set_lockdelay(pgame, 1);
-
-      strncpy(pgame->gamemode, "Infinity", sizeof pgame->gamemode);
-      pgame->check_win = tetris_classic;
       break;
     case TETRIS_CLASSIC:
     default:
@@ -855,12 +2216,12 @@ tetris_set_gamemode(tetris* pgame, enum TETRIS_GAMES gm)
       tetris_set_wallkicks(pgame, 0);
       tetris_set_tspins(pgame, 0);
       tetris_set_lockdelay(pgame, 0);
-
-      strncpy(pgame->gamemode, "Classic", sizeof pgame->gamemode);
-      pgame->check_win = tetris_classic;
+      gm = TETRIS_CLASSIC;
       break;
   }
 
+  pgame->gamemode = gm;
+
   return 1;
 }
 
@@ -878,22 +2239,19 @@ tetris_get_state(tetris* pgame)
   return -1;
 }
 
-int
-tetris_get_name(tetris* pgame, char* ret, size_t len)
-{
-  strncpy(ret, pgame->id, len);
-  if (len > 0)
-    ret[len - 1] = '\0';
-  return 1;
-}
-
-int
-tetris_get_dbfile(tetris* pgame, char* ret, size_t len)
+const char*
+tetris_get_gamemode_name(tetris* pgame)
 {
-  strncpy(ret, pgame->db_file, len);
-  if (len > 0)
-    ret[len - 1] = '\0';
-  return 1;
+  switch (pgame->gamemode) {
+    case TETRIS_40_LINES:
+      return "40 Lines";
+    case TETRIS_INFINITY:
+      return "Infinity";
+    case TETRIS_TIMED: /* XXX, change my name when we define tetris_timed() */
+    case TETRIS_CLASSIC:
+    default:
+      return "Classic";
+  }
 }
 
 /************************************/
@@ -21,31 +21,59 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <sys/queue.h>
-#include <time.h>
 
 struct block;
-struct blocks_head;
 struct tetris;
 
+/* Game dimensions, up to 64 columns and 63 rows. Override both with -D when
+ * building the engine and everything using it; the two top rows are hidden.
+ */
+#ifndef TETRIS_MAX_COLUMNS
+#define TETRIS_MAX_COLUMNS 10
+#endif
+#ifndef TETRIS_MAX_ROWS
+#define TETRIS_MAX_ROWS 22
+#endif
+
+/* A board row has one bit per column, a board column one bit per row plus
+ * the floor. Use the narrowest words that fit.
+ */
+#if TETRIS_MAX_COLUMNS < 4
+#error "TETRIS_MAX_COLUMNS must be at least 4"
+#elif TETRIS_MAX_COLUMNS <= 16
+typedef uint16_t tetris_row;
+#elif TETRIS_MAX_COLUMNS <= 32
+typedef uint32_t tetris_row;
+#elif TETRIS_MAX_COLUMNS <= 64
+typedef uint64_t tetris_row;
+#else
+#error "TETRIS_MAX_COLUMNS must be at most 64"
+#endif
+
+#if TETRIS_MAX_ROWS < 6
+#error "TETRIS_MAX_ROWS must be at least 6"
+#elif TETRIS_MAX_ROWS <= 31
+typedef uint32_t tetris_column;
+#elif TETRIS_MAX_ROWS <= 63
+typedef uint64_t tetris_column;
+#else
+#error "TETRIS_MAX_ROWS must be at most 63"
+#endif
+
 /* Check if the given (Y, X) coordinate contains a block */
-#define tetris_at_yx(G, Y, X) ((G)->spaces[(Y)] & (1 << (X)))
+#define tetris_at_yx(G, Y, X) ((G)->spaces[(Y)] & ((tetris_row)1 << (X)))
 
 /* Set/Unset location (Y, X) on board */
-#define tetris_set_yx(G, Y, X) ((G)->spaces[(Y)] |= (1 << (X)))
-#define tetris_unset_yx(G, Y, X) ((G)->spaces[(Y)] &= ~(1 << (X)))
-
-#define HOLD_BLOCK(G) ((G)->blocks_head.lh_first)
-#define CURRENT_BLOCK(G) (HOLD_BLOCK((G))->entries.le_next)
-#define FIRST_NEXT_BLOCK(G) (CURRENT_BLOCK((G))->entries.le_next)
+#define tetris_set_yx(G, Y, X) ((G)->spaces[(Y)] |= ((tetris_row)1 << (X)))
+#define tetris_unset_yx(G, Y, X) ((G)->spaces[(Y)] &= ~((tetris_row)1 << (X)))
 
-/* Game dimensions */
-#define TETRIS_MAX_COLUMNS 10
-#define TETRIS_MAX_ROWS 22
+#define CURRENT_BLOCK(G) (&(G)->current_block)
 
-/* Number of "next" blocks */
+/* Default number of "next" blocks, see tetris_set_next_len() */
 #define TETRIS_NEXT_BLOCKS_LEN 5
+#define TETRIS_NEXT_BLOCKS_MAX 16
 
 /* Block types */
 #define TETRIS_I_BLOCK 1
@@ -58,41 +86,97 @@ struct tetris;
 
 #define TETRIS_NUM_BLOCKS 7
 
-typedef struct block block;
-struct block
+/* Each block type in each of its 4 rotations. Rotating right moves to the
+ * next rotation, rotating left to the previous one.
+ *
+ * rows[] is the bounding box of the block as row bitmasks, bit n of rows[i]
+ * is set when column (x + n) of row (y + i) is part of the block. x and y are
+ * the offsets of the bounding box from the pivot at (col_off, row_off).
+ * bottom[n] is the row of the lowest piece in column (x + n) of the box.
+ * p[] holds the same four pieces as coordinates relative to the pivot.
+ */
+struct tetris_shape
 {
-  uint8_t soft_drop, hard_drop;
-  uint8_t type;
-  bool hold;       /* Has the block been in the hold box */
-  bool t_spin;     /* Did we do a t spin */
-  bool lock_delay; /* Have we waited an additional game tick */
-
-  uint8_t col_off, row_off;
+  uint8_t rows[4];
+  int8_t x, y;
+  uint8_t width, height;
+  uint8_t bottom[4];
   struct pieces
   {
     int8_t x, y;
   } p[4];
+};
 
-  LIST_ENTRY(block) entries;
+extern const struct tetris_shape tetris_shapes[TETRIS_NUM_BLOCKS + 1][4];
+
+/* Shape of the block in its current rotation */
+#define tetris_block_shape(B) (&tetris_shapes[(B)->type][(B)->rotation])
+
+/* T-spins, by the three-corner rule */
+enum TETRIS_T_SPIN
+{
+  TETRIS_T_SPIN_NONE,
+  TETRIS_T_SPIN_MINI,
+  TETRIS_T_SPIN_FULL,
+};
+
+/* Wall kicks tried by a rotation, see tetris_get_kick() */
+#define TETRIS_NUM_KICKS 5
+
+typedef struct block block;
+struct block
+{
+  uint8_t soft_drop, hard_drop;
+  uint8_t type;
+  uint8_t rotation; /* [0, 3], index into tetris_shapes[type] */
+  bool hold;        /* Has the block been in the hold box */
+  bool last_rot;    /* Was the last successful move a rotation */
+  uint8_t kick;     /* Wall kick used by the last rotation, 0 if none */
+  uint8_t t_spin;   /* enum TETRIS_T_SPIN, set when the block locks */
+  bool lock_delay;  /* Have we waited an additional game tick */
+
+  int8_t col_off, row_off; /* The pivot, which can be off the board */
 };
 
 typedef struct tetris tetris;
 struct tetris
 {
-  uint16_t spaces[TETRIS_MAX_ROWS];
-  uint16_t level;
-  uint32_t lines_destroyed;
-  uint32_t score;
+  /* Hot state first, everything a command or game tick touches. Everything
+   * here is plain data, a game can be copied with memcpy(). Names, save
+   * files and the like belong to the caller. */
+
+  /* One bit per column. The 3 rows after the board are kept full as a floor,
+   * so a block's 4 rows can be tested against the board whenever its top row
+   * is on the board. */
+  tetris_row spaces[TETRIS_MAX_ROWS + 3];
+  block current_block;
+  tetris_column columns[TETRIS_MAX_COLUMNS]; // spaces[] by column
 
-  uint8_t* colors[TETRIS_MAX_ROWS];
+  /* Board metrics, kept up to date as blocks lock and lines clear */
+  uint8_t heights[TETRIS_MAX_COLUMNS];      // Rows up to the top block
+  uint8_t column_holes[TETRIS_MAX_COLUMNS]; // Empty spaces below the top
+  uint8_t row_fill[TETRIS_MAX_ROWS];        // Blocks in each row
+  uint8_t max_height;
+  uint16_t holes;
+
+  uint32_t score;
+  uint32_t lines_destroyed;
+  uint32_t pieces; // Blocks locked into the board
   uint32_t tick_nsec; // Nanoseconds between game ticks
+  uint16_t level;
+  uint8_t gamemode; // enum TETRIS_GAMES
 
-  int (*check_win)(tetris*); // Game over when this return 0
+  /* Block types, 0 when the hold box is empty */
+  uint8_t hold_block;
+  uint8_t next_blocks[TETRIS_NEXT_BLOCKS_MAX]; // Ring buffer, always full
+  uint8_t next_head, next_len;                 // next_len are shown
 
   uint8_t bag[TETRIS_NUM_BLOCKS]; // Get random blocks
+  uint8_t bag_index;              // Next block taken from the bag
+  uint64_t rng_state;             // See tetris_set_seed()
 
-  LIST_HEAD(blocks_head, block) blocks_head;
-  block* ghost_block;
+  uint64_t clock_nsec;   // Game time, see tetris_advance()
+  uint64_t tick_elapsed; // Nanoseconds since the last game tick
 
   /* Attributes */
   bool enable_wallkicks;
@@ -105,20 +189,148 @@ struct tetris
   bool win;
   bool lose;
   bool quit;
-  bool difficult; // successive difficult moves
+  bool difficult;   // successive difficult moves
+  bool ghost_dirty; // ghost_block needs to be moved
+
+  /* Cold state, only read to draw the game */
+  uint8_t colors[TETRIS_MAX_ROWS][TETRIS_MAX_COLUMNS];
 
-  char gamemode[16];
-  char db_file[256];
-  char id[16];
-  time_t date;
+  /* Not part of a snapshot, everything above is. The ghost is worked out
+   * again after a restore. */
+  block ghost_block;            // See tetris_get_ghost_block()
+  struct tetris_events* events; // See tetris_set_events()
+  struct tetris_undo* undo;     // See tetris_set_undo()
+  void* user;                   // Caller's data, see tetris_set_user()
 };
 
+/* Log levels passed to the log hook */
+enum TETRIS_LOG_LEVEL
+{
+  TETRIS_LOG_ERR,
+  TETRIS_LOG_DEBUG,
+};
+
+/* The engine has no terminal, database or logging dependencies of its own,
+ * memory is requested through alloc/free and messages are passed to log.
+ * A NULL alloc/free falls back to malloc()/free(), a NULL log drops messages.
+ *
+ * log is given the game the message is about (NULL if there's none), the
+ * hooks may be called from every thread running a game.
+ */
+struct tetris_hooks
+{
+  void* (*alloc)(size_t);
+  void (*free)(void*);
+  void (*log)(tetris*, enum TETRIS_LOG_LEVEL, const char* msg);
+};
+
+/* Install hooks, NULL restores the defaults. Call once, before the first
+ * tetris_init(); games on different threads share the hooks but nothing
+ * else, so distinct games may be used concurrently without locking. */
+void tetris_set_hooks(const struct tetris_hooks*);
+
+/* Things that happened in a game, for the frontend to show */
+enum TETRIS_EVENT_TYPE
+{
+  TETRIS_EVENT_SPAWN,       // block: the new current block
+  TETRIS_EVENT_LOCK,        // block: the block locked into the board
+  TETRIS_EVENT_LINES,       // arg: lines cleared, 4 is a tetris
+  TETRIS_EVENT_T_SPIN,      // arg: lines cleared
+  TETRIS_EVENT_T_SPIN_MINI, // arg: lines cleared
+  TETRIS_EVENT_LEVEL_UP,    // arg: the new level
+  TETRIS_EVENT_HOLD,        // block: the held block, arg: 0 if already held
+  TETRIS_EVENT_GAME_OVER,   // arg: TETRIS_WIN or TETRIS_LOSE
+};
+
+struct tetris_event
+{
+  uint8_t type;  // enum TETRIS_EVENT_TYPE
+  uint8_t block; // Block type
+  uint16_t arg;
+};
+
+/* Caller-owned ring buffer of events. The engine appends to it during play,
+ * overwriting the oldest events when it's full, the caller takes events out
+ * with tetris_events_pop(). size must be a power of 2. */
+struct tetris_events
+{
+  struct tetris_event* buf;
+  uint32_t size;
+  uint32_t head, tail; // Read and write counters
+  uint32_t lost;       // Events overwritten before they were read
+};
+
+int tetris_events_init(struct tetris_events*, struct tetris_event* buf,
+                       uint32_t size);
+/* Returns 1 and the oldest event in ev, or 0 when there are none */
+int tetris_events_pop(struct tetris_events*, struct tetris_event* ev);
+
+/* A snapshot is the whole game but the ghost block and the caller's events,
+ * undo stack and user data, as TETRIS_SNAPSHOT_SIZE bytes of plain data.
+ * Taking or restoring one is a single copy, buf needs no alignment. The
+ * colors are nearly half of it, they're kept so an undo draws right. */
+#define TETRIS_SNAPSHOT_SIZE offsetof(struct tetris, ghost_block)
+
+void tetris_snapshot(const tetris*, void* buf);
+void tetris_restore(tetris*, const void* buf);
+
+/* Caller-owned stack of the last size snapshots, one taken whenever a block
+ * spawns after a lock or a new deal, but not out of the hold box. The oldest
+ * snapshot is dropped when it's full. size must be a power of 2, buf holds
+ * size * TETRIS_SNAPSHOT_SIZE bytes. */
+struct tetris_undo
+{
+  unsigned char* buf;
+  uint32_t size;
+  uint32_t top; // Write counter
+  uint32_t len; // Snapshots on the stack
+};
+
+int tetris_undo_init(struct tetris_undo*, void* buf, uint32_t size);
+/* Attach an undo stack to a game, or detach it with NULL. The game as it is
+ * goes on the stack at once, so the first block locked after can be taken
+ * back. */
+int tetris_set_undo(tetris*, struct tetris_undo*);
+/* Take back the last block locked, the game goes back to when that block
+ * spawned. Returns 1, or -1 when there's nothing to undo. */
+int tetris_undo(tetris*);
+
 /* Create game state */
 int tetris_init(tetris**);
 
 /* Free memory */
 int tetris_cleanup(tetris*);
 
+/* Create game state in buf, without allocating. buf must hold
+ * tetris_sizeof() bytes, aligned like a struct tetris. There's nothing to
+ * clean up, just release buf. */
+size_t tetris_sizeof(void);
+tetris* tetris_init_in(void* buf);
+
+/* Start over on an empty board. The game mode, attributes, events, undo
+ * stack and user data are kept, the blocks continue on from the same random
+ * sequence. The undo stack is emptied. */
+int tetris_reset(tetris*);
+
+/* A fixed number of games, allocated once and recycled. Games from
+ * tetris_pool_get() are initialized as by tetris_init(), it returns NULL
+ * when every game is in use. tetris_pool_put() returns -1 for a game that
+ * isn't from the pool or was already put back. A pool may only be used by
+ * one thread. */
+typedef struct tetris_pool tetris_pool;
+struct tetris_pool
+{
+  tetris* games;
+  tetris** free; // Stack of unused games
+  bool* in_use;  // By game, set while the caller has it
+  size_t len, cap;
+};
+
+int tetris_pool_init(tetris_pool*, size_t n);
+tetris* tetris_pool_get(tetris_pool*);
+int tetris_pool_put(tetris_pool*, tetris*);
+void tetris_pool_cleanup(tetris_pool*);
+
 /* Commands */
 #define TETRIS_MOVE_LEFT 0x00
 #define TETRIS_MOVE_RIGHT 0x01
@@ -135,13 +347,82 @@ int tetris_cleanup(tetris*);
 /* Process key command in ch and modify game */
 int tetris_cmd(tetris*, int command);
 
+/* Process up to n commands, stopping after the command that locks a block
+ * or ends the game. Returns the number of commands used. */
+size_t tetris_cmd_batch(tetris*, const uint8_t* cmds, size_t n);
+
+/* Lock the current block, or the block from the hold box with use_hold, in
+ * rotation with its pivot in column. It must get there by turning where it
+ * is, moving across and dropping straight down. Everything happens as for a
+ * hard drop, events included, without running a command per move. Returns
+ * 1 when the block is locked, or -1 when it can't get there or the game is
+ * over, and then the game is unchanged. */
+int tetris_place(tetris*, uint8_t rotation, int column, bool use_hold);
+
+/* A place the current block can lock. The pivot of the block is at column
+ * and row, see struct tetris_shape. */
+struct tetris_move
+{
+  uint8_t rotation;
+  int8_t column, row;
+  bool hold;    // The block comes out of the hold box
+  bool spin;    // A rotation can be the last move, for T-spins
+  uint8_t kick; // The kick of that rotation, see tetris_get_kick()
+};
+
+/* Write up to n places the current block can lock, and the block in the hold
+ * box too with use_hold. These are all the places it can get to by moving,
+ * rotating and falling, tucks and spins included, each set of spaces once.
+ * When a rotation with the last kick gets to a place, kick is that kick, as
+ * it turns a mini T-spin into a full one, otherwise it's 0. Returns the
+ * number of moves written, 0 while the game is paused or over. */
+size_t tetris_moves(const tetris*, struct tetris_move* moves, size_t n,
+                    bool use_hold);
+/* Lock the block at a move from tetris_moves(), as tetris_place() does.
+ * Returns -1 when the block doesn't fit there or could still fall. */
+int tetris_place_move(tetris*, const struct tetris_move*);
+
+/* What a board looks like, to choose between places for a block */
+struct tetris_features
+{
+  uint16_t height;          // The column heights added up
+  uint16_t max_height;      // The highest column
+  uint16_t holes;           // Empty spaces under filled ones
+  uint16_t bumpiness;       // Height differences of columns side by side
+  uint16_t row_transitions; // Filled spaces next to empty, walls are filled
+  uint16_t wells;           // Open spaces with filled spaces on both sides
+};
+
+/* Evaluate n boards of TETRIS_MAX_ROWS rows each, the top row first, into
+ * pf. Batches run a vector of boards at a time, with the widest vectors the
+ * CPU has. */
+void tetris_eval(const tetris_row* boards, size_t n, struct tetris_features*);
+#define tetris_eval_game(G, F) tetris_eval((G)->spaces, 1, (F))
+
+/* How long a hard dropped block waits before locking, with lock delays */
+#define TETRIS_LOCK_DELAY_NSEC 500000000
+
+/* Move the game clock on by nsec nanoseconds, running a game tick each time
+ * the block is due to fall or lock. Time stands still while paused. Returns
+ * the number of game ticks run, or -1 when the game is over, like
+ * tetris_cmd(). Nothing else keeps time, so a game can be played as fast as
+ * the caller likes and the same times always give the same game. */
+int tetris_advance(tetris*, uint64_t nsec);
+/* Nanoseconds until the next game tick */
+uint64_t tetris_next_tick(const tetris*);
+
 /* Set Attributes */
 #define tetris_set_ghosts(G, B) ((G)->enable_ghosts = (B))
 #define tetris_set_wallkicks(G, B) ((G)->enable_wallkicks = (B))
 #define tetris_set_tspins(G, B) ((G)->enable_tspins = (B))
 #define tetris_set_lockdelay(G, B) ((G)->enable_lock_delay = (B))
-int tetris_set_name(tetris*, const char* name);
-int tetris_set_dbfile(tetris*, const char* name);
+#define tetris_set_user(G, P) ((G)->user = (P))
+#define tetris_set_events(G, E) ((G)->events = (E))
+
+/* Copy n rows into the board starting at row, eg. to restore a saved game.
+ * Don't write spaces[] directly, the engine keeps other state in sync.
+ * Returns -1, changing nothing, when a row has bits past the last column. */
+int tetris_set_rows(tetris*, size_t row, const tetris_row* rows, size_t n);
 
 /* Game modes, we win when the game mode returns 1 */
 enum TETRIS_GAMES
@@ -153,6 +434,15 @@ enum TETRIS_GAMES
 };
 int tetris_set_gamemode(tetris*, enum TETRIS_GAMES);
 
+/* Restart the block sequence from seed, the same seed always gives the same
+ * blocks. tetris_init() seeds each game from the clock and the game's
+ * address, so games started together deal different blocks. */
+int tetris_set_seed(tetris*, uint64_t seed);
+
+/* Show between 1 and TETRIS_NEXT_BLOCKS_MAX "next" blocks. All of them are
+ * always dealt ahead, so the blocks are the same however many are shown. */
+int tetris_set_next_len(tetris*, size_t len);
+
 /* Get Attributes */
 enum TETRIS_GAME_STATE
 {
@@ -163,14 +453,39 @@ enum TETRIS_GAME_STATE
 };
 
 enum TETRIS_GAME_STATE tetris_get_state(tetris*);
-int tetris_get_name(tetris*, char*, size_t);
-int tetris_get_dbfile(tetris*, char*, size_t);
+const char* tetris_get_gamemode_name(tetris*);
+#define tetris_get_gamemode(G) ((enum TETRIS_GAMES)(G)->gamemode)
 #define tetris_get_level(G) ((G)->level)
 #define tetris_get_lines(G) ((G)->lines_destroyed)
+#define tetris_get_pieces(G) ((G)->pieces)
 #define tetris_get_score(G) ((G)->score)
 #define tetris_get_delay(G) ((G)->tick_nsec)
+#define tetris_get_time(G) ((G)->clock_nsec)
 #define tetris_get_ghosts(G) ((G)->enable_ghosts)
 #define tetris_get_wallkicks(G) ((G)->enable_wallkicks)
 #define tetris_get_tspins(G) ((G)->enable_tspins)
 #define tetris_get_lockdelay(G) ((G)->enable_lock_delay)
 #define tetris_get_difficult(G) ((G)->difficult)
+
+/* Index of the wall kick the current block's last rotation used, in
+ * [0, TETRIS_NUM_KICKS). 0 is a rotation in place. */
+#define tetris_get_kick(G) (CURRENT_BLOCK(G)->kick)
+#define tetris_get_user(G) ((G)->user)
+
+/* Board metrics: height and holes of column X, blocks in row Y, the highest
+ * column and the total number of holes */
+#define tetris_get_height(G, X) ((G)->heights[(X)])
+#define tetris_get_column_holes(G, X) ((G)->column_holes[(X)])
+#define tetris_get_row_fill(G, Y) ((G)->row_fill[(Y)])
+#define tetris_get_max_height(G) ((G)->max_height)
+#define tetris_get_holes(G) ((G)->holes)
+
+/* Block types in the hold box (0 if empty), and the N'th "next" block */
+#define tetris_get_hold(G) ((G)->hold_block)
+#define tetris_get_next(G, N)                                                  \
+  ((G)->next_blocks[((G)->next_head + (N)) & (TETRIS_NEXT_BLOCKS_MAX - 1)])
+#define tetris_get_next_len(G) ((G)->next_len)
+
+/* Where the current block would land, NULL when ghosts are disabled. The
+ * ghost is only placed when asked for, after the block or board changed. */
+const block* tetris_get_ghost_block(tetris*);
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2014  James Smith <james@apertum.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Concurrency test. Plays the same seeded games on one thread and then on
+ * several at once, each thread with games of its own, and checks every game
+ * ends the same way both times. Games share the hooks and nothing else, so
+ * any difference, or any report from ThreadSanitizer (make tsan), is state
+ * leaking between games.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tetris.h"
+
+#define MAX_THREADS 64
+
+/* Commands played before a game is given up */
+#define MAX_COMMANDS 20000
+
+/* Moves a block can have, see perft.c */
+#define MAX_MOVES (2 * 4 * TETRIS_MAX_COLUMNS * TETRIS_MAX_ROWS)
+
+struct job
+{
+  uint64_t seed; // Seed of the first game, each game after adds 1
+  unsigned games;
+  pthread_t thread;
+  uint64_t hash; // Of how every game ended
+};
+
+/* Messages logged, by every game on every thread */
+static _Atomic unsigned long messages;
+
+static void
+usage(void)
+{
+  extern const char* __progname;
+
+  fprintf(stderr,
+          "%s version %s\n\n"
+          "Usage:\n\t"
+          "[-u] usage\n\t"
+          "[-g games] games per thread, 32\n\t"
+          "[-j threads] threads, 4\n\n",
+          __progname, VERSION);
+}
+
+static void
+count_log(tetris* pgame, enum TETRIS_LOG_LEVEL level, const char* msg)
+{
+  (void)level;
+  (void)msg;
+
+  if (pgame && tetris_get_user(pgame))
+    (*(unsigned long*)tetris_get_user(pgame))++;
+  atomic_fetch_add_explicit(&messages, 1, memory_order_relaxed);
+}
+
+static uint64_t
+hash_add(uint64_t h, uint64_t v)
+{
+  return (h ^ v) * 0x100000001b3ULL;
+}
+
+static uint64_t
+next_random(uint64_t* state)
+{
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> 33;
+}
+
+/* Play a game with every part of the engine that keeps state of its own:
+ * commands, the clock, placed moves, events, undo and evaluation. Returns a
+ * hash of how it ended. */
+static uint64_t
+play(tetris* pgame, uint64_t seed, struct tetris_move* moves)
+{
+  static const uint8_t cmds[] = {
+    TETRIS_MOVE_LEFT, TETRIS_MOVE_RIGHT, TETRIS_MOVE_DOWN,  TETRIS_ROT_LEFT,
+    TETRIS_ROT_RIGHT, TETRIS_MOVE_DROP,  TETRIS_HOLD_BLOCK, TETRIS_GAME_TICK,
+  };
+
+  struct tetris_event ev_buf[64];
+  struct tetris_events events;
+  unsigned char undo_buf[4 * TETRIS_SNAPSHOT_SIZE];
+  struct tetris_undo undo;
+  unsigned long logged = 0;
+  uint64_t rng = seed, h = seed;
+  bool over = false;
+
+  tetris_events_init(&events, ev_buf, 64);
+  tetris_undo_init(&undo, undo_buf, 4);
+  tetris_set_events(pgame, &events);
+  tetris_set_user(pgame, &logged);
+  tetris_set_gamemode(pgame, seed & 1 ? TETRIS_INFINITY : TETRIS_CLASSIC);
+  tetris_set_seed(pgame, seed);
+
+  /* After the seed, the game as it is goes on the stack */
+  tetris_set_undo(pgame, &undo);
+
+  for (int i = 0; i < MAX_COMMANDS && !over; i++) {
+    uint64_t r = next_random(&rng);
+
+    switch (r % 16) {
+      case 0: {
+        size_t n = tetris_moves(pgame, moves, MAX_MOVES, r & 16);
+        if (n)
+          tetris_place_move(pgame, &moves[(r >> 5) % n]);
+        break;
+      }
+      case 1:
+        tetris_advance(pgame, (r >> 4) % 100000000);
+        break;
+      case 2:
+        if (r & 16)
+          tetris_undo(pgame);
+        break;
+      case 3: {
+        struct tetris_features f;
+        tetris_eval_game(pgame, &f);
+        h = hash_add(h, f.height << 16 | f.holes);
+        break;
+      }
+      default:
+        over = tetris_cmd(pgame, cmds[(r >> 4) % sizeof cmds]) == -1;
+        break;
+    }
+
+    struct tetris_event ev;
+    while (tetris_events_pop(&events, &ev) == 1)
+      h = hash_add(h, (uint64_t)ev.type << 24 | ev.block << 16 | ev.arg);
+  }
+
+  h = hash_add(h, tetris_get_score(pgame));
+  h = hash_add(h, tetris_get_lines(pgame));
+  h = hash_add(h, logged);
+
+  tetris_set_events(pgame, NULL);
+  tetris_set_undo(pgame, NULL);
+  tetris_set_user(pgame, NULL);
+
+  return h;
+}
+
+static void*
+job_run(void* arg)
+{
+  struct job* job = arg;
+  struct tetris_move* moves = malloc(MAX_MOVES * sizeof *moves);
+  tetris_pool pool;
+
+  if (!moves || tetris_pool_init(&pool, 2) != 1) {
+    fprintf(stderr, "Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  job->hash = 0;
+
+  /* Games alternate between a pool of the thread's own and the heap */
+  for (unsigned i = 0; i < job->games; i++) {
+    tetris* pgame;
+    if (i & 1)
+      pgame = tetris_pool_get(&pool);
+    else if (tetris_init(&pgame) != 1)
+      pgame = NULL;
+    if (!pgame) {
+      fprintf(stderr, "Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    job->hash = hash_add(job->hash, play(pgame, job->seed + i, moves));
+
+    if (i & 1)
+      tetris_pool_put(&pool, pgame);
+    else
+      tetris_cleanup(pgame);
+  }
+
+  tetris_pool_cleanup(&pool);
+  free(moves);
+
+  return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+  static struct job jobs[MAX_THREADS];
+  unsigned long threads = 4, games = 32;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "g:j:u")) != -1) {
+    switch (ch) {
+      case 'g':
+        games = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'u':
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+        break;
+    }
+  }
+
+  if (!threads || threads > MAX_THREADS || !games) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  struct tetris_hooks hooks = { .log = count_log };
+  tetris_set_hooks(&hooks);
+
+  /* Every job one after another, for the hashes to expect */
+  uint64_t expected[MAX_THREADS];
+  for (unsigned long i = 0; i < threads; i++) {
+    jobs[i].seed = i * games + 1;
+    jobs[i].games = games;
+    job_run(&jobs[i]);
+    expected[i] = jobs[i].hash;
+  }
+
+  for (unsigned long i = 0; i < threads; i++)
+    if (pthread_create(&jobs[i].thread, NULL, job_run, &jobs[i])) {
+      fprintf(stderr, "Can't start thread %lu\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+  int failed = 0;
+  for (unsigned long i = 0; i < threads; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].hash != expected[i]) {
+      printf("thread %2lu  FAIL, %016llx expected %016llx\n", i,
+             (unsigned long long)jobs[i].hash,
+             (unsigned long long)expected[i]);
+      failed++;
+    }
+  }
+
+  printf("%lu threads, %lu games each, %lu messages logged  %s\n", threads,
+         games, (unsigned long)atomic_load(&messages), failed ? "FAIL" : "ok");
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}